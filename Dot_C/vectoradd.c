@@ -4,9 +4,12 @@
 // System includes
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // OpenCL includes
 #include <CL/cl.h>
+#include "clruntime.h"
+#include "verify.h"
 
 // Simple OpenCL error checking function
 void chk(cl_int status, const char* cmd) {
@@ -42,107 +45,34 @@ void execute(int* A, int* B, int* C,const int* elements) {
 
     // Use this to check the output of each API call
     cl_int status;  
-     
-    // Retrieve the number of platforms
-    cl_uint numPlatforms = 0;
-    status = clGetPlatformIDs(0, NULL, &numPlatforms);
-    chk(status, "clGetPlatformIDs");
-
- 
-    // Allocate enough space for each platform
-    cl_platform_id *platforms = NULL;
-    platforms = (cl_platform_id*)malloc(
-        numPlatforms*sizeof(cl_platform_id));
- 
-    // Fill in the platforms
-    status = clGetPlatformIDs(numPlatforms, platforms, NULL);
-
-    // Retrieve the number of devices
-    cl_uint numDevices = 0;
-    status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, 0, 
-        NULL, &numDevices);
-    chk(status, "clGetDeviceIDs");
-
-    // Allocate enough space for each device
-    cl_device_id *devices;
-    devices = (cl_device_id*)malloc(
-        numDevices*sizeof(cl_device_id));
-
-    // Fill in the devices 
-    status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL,        
-        numDevices, devices, NULL);
-    chk(status, "clGetDeviceIDs");
-
-    // Create a context and associate it with the devices
-    cl_context context;
-    context = clCreateContext(NULL, numDevices, devices, NULL, 
-        NULL, &status);
-    chk(status, "clCreateContext");
-
-    // Create a command queue and associate it with the device 
-    cl_command_queue cmdQueue;
-    cmdQueue = clCreateCommandQueue(context, devices[0], 0, 
-        &status);
-    chk(status, "clCreateCommandQueue");
 
+    // Discovery, context and queue happen on the first call only; the
+    // runtime lives as long as the shared object stays loaded in R.
+    OclRuntime* rt = oclRuntime();
+    cl_command_queue cmdQueue = rt->queue;
 
     // Create a buffer object that will contain the data 
-    // from the host array A
+    // from the host array A. On unified memory devices the kernel reads
+    // R's vector in place instead of a copy.
     cl_mem bufA;
-    bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, datasize,                       NULL, &status);
-    chk(status, "clCreateBuffer");
+    bufA = oclBuffer(rt, CL_MEM_READ_ONLY, datasize, A, datasize);
 
     // Create a buffer object that will contain the data 
     // from the host array B
     cl_mem bufB;
-    bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, datasize,                        NULL, &status);
-    chk(status, "clCreateBuffer");
+    bufB = oclBuffer(rt, CL_MEM_READ_ONLY, datasize, B, datasize);
 
     // Create a buffer object that will hold the output data
     cl_mem bufC;
-    bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, datasize,
-        NULL, &status); 
-    chk(status, "clCreateBuffer");
-    
-    // Write input array A to the device buffer bufferA
-    status = clEnqueueWriteBuffer(cmdQueue, bufA, CL_FALSE, 
-        0, datasize, A, 0, NULL, NULL);
-    chk(status, "clEnqueueWriteBuffer");    
-    // Write input array B to the device buffer bufferB
-    status = clEnqueueWriteBuffer(cmdQueue, bufB, CL_FALSE, 
-        0, datasize, B, 0, NULL, NULL);
-
-    // Create a program with source code
-    cl_program program = clCreateProgramWithSource(context, 1, 
-        (const char**)&programSource, NULL, &status);
-    chk(status, "clCreateProgramWithSource");
-
-    // Build (compile) the program for the device
-    // Show log if errors occur
-
-    if (clBuildProgram(program, numDevices, devices, NULL, NULL, NULL) 
-        != CL_SUCCESS) 
-        {
-         // Shows the log
-         size_t log_size;
-         // First call to get the proper size
-         clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, 
-            NULL, &log_size);
-         char build_log[log_size+1] ;
-         // Second call to get the log
-         clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 
-            log_size, build_log, NULL);
-         build_log[log_size] = '\0';
-         printf("Compile error: %s \n", build_log) ;
-         free(build_log) ;
-         exit(-1);
-        }
-  
+    bufC = oclBuffer(rt, CL_MEM_WRITE_ONLY, datasize, C, datasize);
+
+    // Build (compile) the program once and reuse it on later calls
+    cl_program program = oclGetProgram(rt, programSource,
+        strlen(programSource), NULL);
 
     // Create the vector addition kernel
     cl_kernel kernel;
-    kernel = clCreateKernel(program, "vecadd", &status);
-    chk(status, "clCreateKernel");
+    kernel = oclGetKernel(rt, program, "vecadd");
 
 
     // Associate the input and output buffers with the kernel 
@@ -165,37 +95,41 @@ void execute(int* A, int* B, int* C,const int* elements) {
     chk(status, "clEnqueueNDRangeKernel");
 
 
-    // Read the device output buffer to the host output array
-    clEnqueueReadBuffer(cmdQueue, bufC, CL_TRUE, 0, 
-        datasize, C, 0, NULL, NULL);
-    chk(status, "clEnqueueReadBuffer");
+    // Read the device output buffer to the host output array (a map
+    // and unmap when bufC already is C)
+    oclReadBuffer(rt, bufC, datasize, C);
 
 
-    // Verify the output
-    //int result = 1;
-    //int i;
-    //for(i = 0; i < *elements; i++) {
-    //    if(C[i] != i+i) {
-    //        result = 0;
-    //        break;
-    //    }
-    //}
+    // With VERIFY_RESULTS set, check the output against A + B on the host;
+    // integer sums must match exactly. Only a failure is reported, R gets C
+    // either way.
+    if(verifyEnabled()) {
+        int* ref = (int*) malloc(datasize);
+        int i;
+        for(i = 0; i < *elements; i++) {
+            ref[i] = A[i] + B[i];
+        }
+        VerifyOptions vopts;
+        VerifyResult check;
+        verifyDefaults(&vopts);
+        vopts.abs_tol = 0.0;
+        vopts.rel_tol = 0.0;
+        if(!verifyArrays(C, ref, *elements, VERIFY_INT, &vopts, &check)) {
+            printf("vecadd: output is incorrect\n");
+            verifyReport(&check, C, ref, VERIFY_INT, &vopts);
+        }
+        free(ref);
+    }
 
-    // Free OpenCL resources
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(cmdQueue);
+    // Free OpenCL resources (program, kernel and queue stay cached)
     clReleaseMemObject(bufA);
     clReleaseMemObject(bufB);
     clReleaseMemObject(bufC);
-    clReleaseContext(context);
 
     // Free host resources
     //free(A);
     //free(B);
     //free(C);
-    free(platforms);
-    free(devices);
 
     
 }
@@ -0,0 +1,69 @@
+// Compare loading a matrix with the fscanf based readDataFile against the
+// memory mapped binary container. The checksum forces every page of the
+// mapping to be touched so the comparison includes the real I/O.
+//
+// usage: bench_load.o A.txt A.bin [trials]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "matrixio.h"
+
+double walltime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec*1e-9);
+}
+
+double checksum(const float* data, size_t count)
+{
+    double sum = 0.0;
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        sum += data[i];
+    }
+    return(sum);
+}
+
+int main(int argc, char** argv)
+{
+    int trials = 3;
+    int t, rows, cols;
+    double start, txt_time = 0.0, bin_time = 0.0;
+    double txt_sum = 0.0, bin_sum = 0.0;
+
+    if (argc < 3)
+    {
+        printf("usage: %s A.txt A.bin [trials]\n", argv[0]);
+        return(1);
+    }
+    if (argc > 3)
+    {
+        trials = atoi(argv[3]);
+    }
+
+    for (t = 0; t < trials; t++)
+    {
+        start = walltime();
+        float* data = readDataFile(argv[1], &rows, &cols);
+        txt_sum = checksum(data, (size_t) rows*cols);
+        free(data);
+        txt_time += walltime() - start;
+
+        MatrixFile mf;
+        start = walltime();
+        openMatrixFile(argv[2], MATRIX_FLOAT, &mf);
+        bin_sum = checksum((float*) mf.data, (size_t) mf.rows*mf.cols);
+        closeMatrixFile(&mf);
+        bin_time += walltime() - start;
+    }
+
+    printf("text   (fscanf): %.4lf sec per load, checksum %g\n",
+            txt_time/trials, txt_sum);
+    printf("binary (mmap):   %.4lf sec per load, checksum %g\n",
+            bin_time/trials, bin_sum);
+    printf("speedup: %.1fx\n", txt_time/bin_time);
+    return(0);
+}
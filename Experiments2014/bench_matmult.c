@@ -0,0 +1,449 @@
+// Matrix multiply benchmark: sweeps problem sizes, precisions and kernel
+// variants and reports GFLOP/s, GB/s and the transfer/compute split, one
+// row per (variant, precision, size), as CSV or JSON.
+//
+// Variants: naive   the one-row-dot-product kernel of ../hw4/matmult.kernel
+//                   (B column-major, fp32 only)
+//           tiled   matmult in matmult_partitioning.kernel
+//           regblock matmult_regblock, 4x4 outputs per work-item
+//           cpu     the blocked host GEMM (cpugemm.h)
+// Wall times come from the monotonic clock around the whole call
+// (buffers, transfers, kernel, read back); write/kernel/read times from
+// OpenCL profiling events. Each row is checked once against the host GEMM.
+//
+// usage: bench_matmult.o [-size MxKxN]... [-precision fp32,fp64]
+//            [-variant naive,tiled,regblock,cpu] [-trials N] [-warmup N]
+//            [-csv file] [-json file]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+#include "clruntime.h"
+#include "cpugemm.h"
+#include "matrixio.h"
+#include "verify.h"
+
+#define PROGRAM_FILE "./matmult_partitioning.kernel"
+#define NAIVE_PROGRAM_FILE "../hw4/matmult.kernel"
+#define BENCH_MAX_SIZES 32
+#define BENCH_WPT 4
+
+typedef struct
+{
+    const char* name;
+    int dtype;
+    size_t elsize;
+    const char* options;
+} BenchPrecision;
+
+static const BenchPrecision bench_precisions[] = {
+    {"fp32", MATRIX_FLOAT, sizeof(float), "-DREAL=float"},
+    {"fp64", MATRIX_DOUBLE, sizeof(double), "-DREAL=double -DFP_64=1"},
+};
+
+// Square sizes plus skinny, wide and odd shapes
+static int default_sizes[][3] = {
+    {128, 128, 128}, {256, 256, 256}, {512, 512, 512}, {1024, 1024, 1024},
+    {1024, 64, 1024}, {64, 1024, 64}, {2000, 300, 700}, {1000, 1000, 1}
+};
+
+// Means over the timed trials, in seconds
+typedef struct
+{
+    double wall;
+    double wall_min;
+    double write;
+    double kernel;
+    double read;
+} BenchTimes;
+
+static void chk(cl_int status, const char* cmd)
+{
+    if (status != CL_SUCCESS)
+    {
+        printf("%s failed (%d)\n", cmd, status);
+        exit(-1);
+    }
+}
+
+static double eventSeconds(cl_event ev)
+{
+    cl_ulong start, end;
+    clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(start),
+            &start, NULL);
+    clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(end),
+            &end, NULL);
+    return((end - start)*1e-9);
+}
+
+static int inList(const char* list, const char* name)
+{
+    size_t len = strlen(name);
+    const char* p = list;
+    while ((p = strstr(p, name)) != NULL)
+    {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+        {
+            return(1);
+        }
+        p += len;
+    }
+    return(0);
+}
+
+static int deviceHasDouble(OclRuntime* rt)
+{
+    char ext[4096];
+    clGetDeviceInfo(rt->device, CL_DEVICE_EXTENSIONS, sizeof(ext), ext, NULL);
+    return(strstr(ext, "cl_khr_fp64") != NULL);
+}
+
+// One C = A*B on the device with the given variant. B is passed as is, so
+// the naive kernel must be given B column-major.
+static void runDevice(OclRuntime* rt, const char* variant,
+        const BenchPrecision* p, void* C, const void* A, const void* B,
+        int M, int K, int N, BenchTimes* t)
+{
+    cl_int status;
+    cl_event ev[4];
+    size_t local[2], global[2];
+    size_t sizeA = p->elsize*(size_t) M*K;
+    size_t sizeB = p->elsize*(size_t) K*N;
+    size_t sizeC = p->elsize*(size_t) M*N;
+    size_t max_wg;
+    char options[256];
+    cl_program program;
+    cl_kernel kernel;
+
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wg),
+            &max_wg, NULL);
+    int ls = 16;
+    while (ls > 1 && (size_t) ls*ls > max_wg)
+    {
+        ls /= 2;
+    }
+    local[0] = local[1] = ls;
+    global[0] = ((N + ls - 1)/ls)*ls;
+    global[1] = ((M + ls - 1)/ls)*ls;
+
+    if (strcmp(variant, "naive") == 0)
+    {
+        program = build_program(rt, NAIVE_PROGRAM_FILE, "");
+        kernel = oclGetKernel(rt, program, "matmult");
+    }
+    else if (strcmp(variant, "regblock") == 0)
+    {
+        int tile = ls*BENCH_WPT;
+        sprintf(options, "%s -DTILE_M=%d -DTILE_N=%d -DTILE_K=16 -DWPT_M=%d "
+                "-DWPT_N=%d", p->options, tile, tile, BENCH_WPT, BENCH_WPT);
+        program = build_program(rt, PROGRAM_FILE, options);
+        kernel = oclGetKernel(rt, program, "matmult_regblock");
+        global[0] = ((N + tile - 1)/tile)*ls;
+        global[1] = ((M + tile - 1)/tile)*ls;
+    }
+    else
+    {
+        program = build_program(rt, PROGRAM_FILE, p->options);
+        kernel = oclGetKernel(rt, program, "matmult");
+    }
+
+    double start = walltime();
+    cl_mem bufA = clCreateBuffer(rt->context, CL_MEM_READ_ONLY, sizeA, NULL,
+            &status);
+    chk(status, "clCreateBuffer");
+    cl_mem bufB = clCreateBuffer(rt->context, CL_MEM_READ_ONLY, sizeB, NULL,
+            &status);
+    chk(status, "clCreateBuffer");
+    cl_mem bufC = clCreateBuffer(rt->context, CL_MEM_WRITE_ONLY, sizeC, NULL,
+            &status);
+    chk(status, "clCreateBuffer");
+    status = clEnqueueWriteBuffer(rt->queue, bufA, CL_FALSE, 0, sizeA, A, 0,
+            NULL, &ev[0]);
+    status |= clEnqueueWriteBuffer(rt->queue, bufB, CL_FALSE, 0, sizeB, B, 0,
+            NULL, &ev[1]);
+    chk(status, "clEnqueueWriteBuffer");
+
+    // Both kernel files take (C, A, B, Arows, Brows, Acols, Bcols); the
+    // naive one as unsigned ints, which have the same size.
+    status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufC);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &bufA);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufB);
+    status |= clSetKernelArg(kernel, 3, sizeof(int), &M);
+    status |= clSetKernelArg(kernel, 4, sizeof(int), &K);
+    status |= clSetKernelArg(kernel, 5, sizeof(int), &K);
+    status |= clSetKernelArg(kernel, 6, sizeof(int), &N);
+    if (strcmp(variant, "tiled") == 0)
+    {
+        status |= clSetKernelArg(kernel, 7, ls*ls*p->elsize, NULL);
+        status |= clSetKernelArg(kernel, 8, ls*ls*p->elsize, NULL);
+    }
+    chk(status, "clSetKernelArg");
+
+    status = clEnqueueNDRangeKernel(rt->queue, kernel, 2, NULL, global, local,
+            0, NULL, &ev[2]);
+    chk(status, "clEnqueueNDRangeKernel");
+    status = clEnqueueReadBuffer(rt->queue, bufC, CL_TRUE, 0, sizeC, C, 0,
+            NULL, &ev[3]);
+    chk(status, "clEnqueueReadBuffer");
+    clReleaseMemObject(bufA);
+    clReleaseMemObject(bufB);
+    clReleaseMemObject(bufC);
+    double wall = walltime() - start;
+
+    t->wall += wall;
+    if (t->wall_min == 0.0 || wall < t->wall_min) t->wall_min = wall;
+    t->write += eventSeconds(ev[0]) + eventSeconds(ev[1]);
+    t->kernel += eventSeconds(ev[2]);
+    t->read += eventSeconds(ev[3]);
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        clReleaseEvent(ev[i]);
+    }
+}
+
+static void runVariant(OclRuntime* rt, const char* variant,
+        const BenchPrecision* p, void* C, const void* A, const void* B,
+        const void* Bcol, int M, int K, int N, BenchTimes* t)
+{
+    if (strcmp(variant, "cpu") == 0)
+    {
+        double start = walltime();
+        cpuGemm(p->dtype, C, N, 1, A, K, 1, B, N, 1, M, K, N);
+        double wall = walltime() - start;
+        t->wall += wall;
+        t->kernel += wall;
+        if (t->wall_min == 0.0 || wall < t->wall_min) t->wall_min = wall;
+        return;
+    }
+    runDevice(rt, variant, p, C, A, strcmp(variant, "naive") == 0 ? Bcol : B,
+            M, K, N, t);
+}
+
+static void* randomMatrix(const BenchPrecision* p, size_t count)
+{
+    size_t i;
+    void* m = malloc(p->elsize*count);
+    for (i = 0; i < count; i++)
+    {
+        double v = (double) rand()/RAND_MAX - 0.5;
+        if (p->dtype == MATRIX_DOUBLE)
+        {
+            ((double*) m)[i] = v;
+        }
+        else
+        {
+            ((float*) m)[i] = (float) v;
+        }
+    }
+    return(m);
+}
+
+static void* columnMajor(const BenchPrecision* p, const void* B, int K, int N)
+{
+    int k, n;
+    char* Bc = malloc(p->elsize*(size_t) K*N);
+    for (k = 0; k < K; k++)
+    {
+        for (n = 0; n < N; n++)
+        {
+            memcpy(Bc + p->elsize*((size_t) n*K + k),
+                    (const char*) B + p->elsize*((size_t) k*N + n), p->elsize);
+        }
+    }
+    return(Bc);
+}
+
+int main(int argc, char** argv)
+{
+    int sizes[BENCH_MAX_SIZES][3];
+    int num_sizes = 0;
+    const char* precision_list = "fp32,fp64";
+    const char* variant_list = "naive,tiled,regblock,cpu";
+    const char* variants[] = {"naive", "tiled", "regblock", "cpu"};
+    int trials = 5, warmup = 1;
+    FILE* csv = NULL;
+    FILE* json = NULL;
+    int i, s, v, r, rows = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-size") == 0 && i + 1 < argc &&
+                num_sizes < BENCH_MAX_SIZES)
+        {
+            int* d = sizes[num_sizes];
+            if (sscanf(argv[++i], "%dx%dx%d", &d[0], &d[1], &d[2]) != 3)
+            {
+                printf("Sizes are given as MxKxN\n");
+                return(1);
+            }
+            num_sizes++;
+        }
+        else if (strcmp(argv[i], "-precision") == 0 && i + 1 < argc)
+        {
+            precision_list = argv[++i];
+        }
+        else if (strcmp(argv[i], "-variant") == 0 && i + 1 < argc)
+        {
+            variant_list = argv[++i];
+        }
+        else if (strcmp(argv[i], "-trials") == 0 && i + 1 < argc)
+        {
+            trials = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-warmup") == 0 && i + 1 < argc)
+        {
+            warmup = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-csv") == 0 || strcmp(argv[i], "-json") == 0)
+                && i + 1 < argc)
+        {
+            FILE* fp = fopen(argv[i + 1], "w");
+            if (fp == NULL)
+            {
+                printf("Error opening %s for writing\n", argv[i + 1]);
+                return(1);
+            }
+            if (argv[i][1] == 'c') csv = fp; else json = fp;
+            i++;
+        }
+        else
+        {
+            printf("usage: %s [-size MxKxN]... [-precision fp32,fp64] "
+                    "[-variant naive,tiled,regblock,cpu] [-trials N] "
+                    "[-warmup N] [-csv file] [-json file]\n", argv[0]);
+            return(1);
+        }
+    }
+    if (num_sizes == 0)
+    {
+        num_sizes = sizeof(default_sizes)/sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+    if (trials < 1)
+    {
+        trials = 1;
+    }
+    if (csv == NULL && json == NULL)
+    {
+        csv = stdout;
+    }
+
+    OclRuntime* rt = oclRuntime();
+    int has_double = deviceHasDouble(rt);
+    VerifyOptions vopts;
+    verifyDefaults(&vopts);
+    srand(1);
+
+    if (csv != NULL)
+    {
+        fprintf(csv, "variant,precision,M,K,N,trials,wall_ms,wall_min_ms,"
+                "write_ms,kernel_ms,read_ms,gflops,kernel_gbs,transfer_gbs,"
+                "max_rel_err,ok\n");
+    }
+    if (json != NULL)
+    {
+        fprintf(json, "[\n");
+    }
+
+    for (r = 0; r < (int) (sizeof(bench_precisions)/sizeof(bench_precisions[0])); r++)
+    {
+        const BenchPrecision* p = &bench_precisions[r];
+        if (!inList(precision_list, p->name))
+        {
+            continue;
+        }
+        if (p->dtype == MATRIX_DOUBLE && !has_double)
+        {
+            fprintf(stderr, "Skipping fp64: the device has no cl_khr_fp64\n");
+            continue;
+        }
+        for (s = 0; s < num_sizes; s++)
+        {
+            int M = sizes[s][0], K = sizes[s][1], N = sizes[s][2];
+            void* A = randomMatrix(p, (size_t) M*K);
+            void* B = randomMatrix(p, (size_t) K*N);
+            void* Bcol = columnMajor(p, B, K, N);
+            void* C = malloc(p->elsize*(size_t) M*N);
+            void* ref = malloc(p->elsize*(size_t) M*N);
+            cpuGemm(p->dtype, ref, N, 1, A, K, 1, B, N, 1, M, K, N);
+            // compulsory traffic: A and B read once, C written once
+            double bytes = p->elsize*((double) M*K + (double) K*N + (double) M*N);
+            double flops = 2.0*M*K*N;
+
+            for (v = 0; v < 4; v++)
+            {
+                const char* variant = variants[v];
+                BenchTimes t;
+                VerifyResult check;
+                if (!inList(variant_list, variant) ||
+                        (strcmp(variant, "naive") == 0 && p->dtype != MATRIX_FLOAT))
+                {
+                    continue;
+                }
+                for (i = 0; i < warmup; i++)
+                {
+                    memset(&t, 0, sizeof(t));
+                    runVariant(rt, variant, p, C, A, B, Bcol, M, K, N, &t);
+                }
+                memset(&t, 0, sizeof(t));
+                for (i = 0; i < trials; i++)
+                {
+                    runVariant(rt, variant, p, C, A, B, Bcol, M, K, N, &t);
+                }
+                int ok = verifyArrays(C, ref, (size_t) M*N, p->dtype, &vopts,
+                        &check);
+                double wall = t.wall/trials, kernel = t.kernel/trials;
+                double write = t.write/trials, read = t.read/trials;
+                double transfer_gbs = (write + read > 0.0 ?
+                        bytes/(write + read)*1e-9 : 0.0);
+                // -1 for a non-finite error, which JSON cannot hold
+                double err = (isfinite(check.max_rel) ? check.max_rel : -1.0);
+
+                if (csv != NULL)
+                {
+                    fprintf(csv, "%s,%s,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,"
+                            "%.3f,%.3f,%.3f,%.3e,%d\n", variant, p->name, M, K, N,
+                            trials, wall*1e3, t.wall_min*1e3, write*1e3,
+                            kernel*1e3, read*1e3, flops/kernel*1e-9,
+                            bytes/kernel*1e-9, transfer_gbs, err, ok);
+                }
+                if (json != NULL)
+                {
+                    fprintf(json, "%s  {\"variant\": \"%s\", \"precision\": \"%s\", "
+                            "\"M\": %d, \"K\": %d, \"N\": %d, \"trials\": %d, "
+                            "\"wall_ms\": %.4f, \"wall_min_ms\": %.4f, "
+                            "\"write_ms\": %.4f, \"kernel_ms\": %.4f, "
+                            "\"read_ms\": %.4f, \"gflops\": %.3f, "
+                            "\"kernel_gbs\": %.3f, \"transfer_gbs\": %.3f, "
+                            "\"max_rel_err\": %.3e, \"ok\": %s}",
+                            rows > 0 ? ",\n" : "", variant, p->name, M, K, N,
+                            trials, wall*1e3, t.wall_min*1e3, write*1e3,
+                            kernel*1e3, read*1e3, flops/kernel*1e-9,
+                            bytes/kernel*1e-9, transfer_gbs, err,
+                            ok ? "true" : "false");
+                }
+                rows++;
+            }
+            free(A);
+            free(B);
+            free(Bcol);
+            free(C);
+            free(ref);
+        }
+    }
+
+    if (json != NULL)
+    {
+        fprintf(json, "\n]\n");
+        fclose(json);
+    }
+    if (csv != NULL && csv != stdout)
+    {
+        fclose(csv);
+    }
+    oclReleaseRuntime();
+    return(0);
+}
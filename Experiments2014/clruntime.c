@@ -0,0 +1,816 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "clruntime.h"
+
+// Progress messages (device selection, runtime setup, program cache hits)
+// go to stderr, so programs that write results to stdout keep it clean.
+static OclRuntime* runtime = NULL;
+
+cl_device_id create_device()
+{
+    int err;
+    cl_uint num_platforms;
+    cl_platform_id platforms[100];
+    err = clGetPlatformIDs(100, platforms, &num_platforms);
+    if (err < 0)
+    {
+        perror("Couldn't identify platform.");
+        exit(1);
+    }
+    fprintf(stderr, "%d platforms detected\n", num_platforms);
+    int pid = 0;
+    fprintf(stderr, "Selecting platform id: %d\n", pid);
+    cl_device_id dev;
+    err = clGetDeviceIDs((platforms[pid]), CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
+    fprintf(stderr, "Device Retreived");
+    if (err == CL_DEVICE_NOT_FOUND)
+    {
+        fprintf(stderr, "Couldn't find GPU!\n");
+        err = clGetDeviceIDs(platforms[pid], CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+    }
+    if (err<0)
+    {
+        perror("Couldn't access any devices.\n");
+        exit(1);
+    }
+    return(dev);
+}
+
+// Whether create_device would find a GPU or CPU device, without exiting
+// when there is none.
+int oclDeviceAvailable()
+{
+    cl_uint num_platforms = 0, num_devices = 0;
+    cl_platform_id platform;
+    if (clGetPlatformIDs(1, &platform, &num_platforms) != CL_SUCCESS ||
+            num_platforms == 0)
+    {
+        return(0);
+    }
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_CPU, 0,
+            NULL, &num_devices) != CL_SUCCESS)
+    {
+        return(0);
+    }
+    return(num_devices > 0);
+}
+
+// Monotonic wall clock in seconds.
+double walltime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec*1e-9);
+}
+
+static void ocl_check(cl_int status, const char* cmd)
+{
+    if (status != CL_SUCCESS)
+    {
+        printf("%s failed (%d)\n", cmd, status);
+        exit(-1);
+    }
+}
+
+// Build a runtime (context, profiling queue, empty caches) around dev.
+OclRuntime* oclRuntimeForDevice(cl_device_id dev)
+{
+    cl_int status;
+    OclRuntime* rt = (OclRuntime*) calloc(1, sizeof(OclRuntime));
+    rt->device = dev;
+    status = clGetDeviceInfo(rt->device, CL_DEVICE_PLATFORM,
+            sizeof(cl_platform_id), &rt->platform, NULL);
+    ocl_check(status, "clGetDeviceInfo");
+    clGetDeviceInfo(rt->device, CL_DEVICE_NAME,
+            sizeof(rt->device_name), rt->device_name, NULL);
+    clGetDeviceInfo(rt->device, CL_DRIVER_VERSION,
+            sizeof(rt->driver_version), rt->driver_version, NULL);
+
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(rt->device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+            sizeof(unified), &unified, NULL);
+    clGetDeviceInfo(rt->device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+            sizeof(rt->base_align), &rt->base_align, NULL);
+    rt->base_align /= 8;
+    rt->zero_copy = (unified == CL_TRUE);
+    const char* env = getenv("OCL_ZERO_COPY");
+    if (env != NULL && *env != '\0')
+    {
+        rt->zero_copy = atoi(env);
+    }
+
+    cl_context_properties props[3] = {CL_CONTEXT_PLATFORM,
+        (cl_context_properties)(rt->platform), 0};
+    rt->context = clCreateContext(props, 1, &rt->device, NULL,
+            NULL, &status);
+    ocl_check(status, "clCreateContext");
+
+    rt->queue = clCreateCommandQueue(rt->context, rt->device,
+            CL_QUEUE_PROFILING_ENABLE, &status);
+    ocl_check(status, "clCreateCommandQueue");
+    return(rt);
+}
+
+// Return the process wide runtime, creating it on first use.
+OclRuntime* oclRuntime()
+{
+    double start;
+    if (runtime != NULL)
+    {
+        return(runtime);
+    }
+    start = walltime();
+    runtime = oclRuntimeForDevice(create_device());
+    fprintf(stderr, "OpenCL runtime created in %.3lf ms\n", (walltime() - start)*1e3);
+    fprintf(stderr, "Zero-copy buffers: %s\n", runtime->zero_copy ? "on" : "off");
+    return(runtime);
+}
+
+void oclFreeRuntime(OclRuntime* rt)
+{
+    int i, k;
+    for (i = 0; i < rt->num_programs; i++)
+    {
+        OclProgramEntry* entry = &rt->programs[i];
+        for (k = 0; k < entry->num_kernels; k++)
+        {
+            clReleaseKernel(entry->kernels[k]);
+            free(entry->kernel_names[k]);
+        }
+        clReleaseProgram(entry->program);
+        free(entry->options);
+    }
+    for (i = 0; i < OCL_MAX_QUEUES; i++)
+    {
+        if (rt->extra_queues[i] != NULL)
+        {
+            clReleaseCommandQueue(rt->extra_queues[i]);
+        }
+    }
+    if (rt->cache_hits + rt->cache_misses > 0)
+    {
+        fprintf(stderr, "Program binary cache: %d hits, %d misses\n",
+                rt->cache_hits, rt->cache_misses);
+    }
+    clReleaseCommandQueue(rt->queue);
+    clReleaseContext(rt->context);
+    free(rt);
+}
+
+void oclReleaseRuntime()
+{
+    if (runtime == NULL)
+    {
+        return;
+    }
+    oclFreeRuntime(runtime);
+    runtime = NULL;
+}
+
+// Every device on every platform. With split > 1 each device that supports
+// it is partitioned into split equal sub-devices, which is how several
+// devices can be exercised on a single CPU runtime.
+int oclListDevices(cl_device_id* devs, int max_devs, int split)
+{
+    cl_platform_id platforms[16];
+    cl_device_id found[OCL_MAX_DEVICES];
+    cl_uint num_platforms = 0, num_found, p, d;
+    int n = 0;
+    clGetPlatformIDs(16, platforms, &num_platforms);
+    for (p = 0; p < num_platforms && p < 16; p++)
+    {
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, OCL_MAX_DEVICES,
+                    found, &num_found) != CL_SUCCESS)
+        {
+            continue;
+        }
+        for (d = 0; d < num_found && d < OCL_MAX_DEVICES && n < max_devs; d++)
+        {
+            cl_uint units = 0, num_sub = 0;
+            clGetDeviceInfo(found[d], CL_DEVICE_MAX_COMPUTE_UNITS,
+                    sizeof(units), &units, NULL);
+            if (split > 1 && units >= (cl_uint) split)
+            {
+                cl_device_partition_property props[3] = {
+                    CL_DEVICE_PARTITION_EQUALLY, units/split, 0};
+                if (clCreateSubDevices(found[d], props, max_devs - n,
+                            devs + n, &num_sub) == CL_SUCCESS && num_sub > 0)
+                {
+                    n += (num_sub < (cl_uint) (max_devs - n) ?
+                            num_sub : (cl_uint) (max_devs - n));
+                    continue;
+                }
+            }
+            devs[n++] = found[d];
+        }
+    }
+    return(n);
+}
+
+// Partition dev into one sub-device per NUMA node. Returns 0 when the
+// device cannot be split that way.
+int oclNumaDevices(cl_device_id dev, cl_device_id* subs, int max_subs)
+{
+    cl_uint num_sub = 0;
+    cl_device_partition_property props[3] = {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+        CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+    if (clCreateSubDevices(dev, props, max_subs, subs, &num_sub) != CL_SUCCESS)
+    {
+        return(0);
+    }
+    return(num_sub < (cl_uint) max_subs ? (int) num_sub : max_subs);
+}
+
+// Native kernel body for oclDeviceNode: records the NUMA node of the CPU
+// it runs on, or -2 when that can't be read.
+static void CL_CALLBACK node_probe(void* args)
+{
+    int* node = *(int**) args;
+    *node = -2;
+#ifdef SYS_getcpu
+    unsigned int cpu, cpu_node;
+    if (syscall(SYS_getcpu, &cpu, &cpu_node, NULL) == 0)
+    {
+        *node = (int) cpu_node;
+    }
+#endif
+}
+
+// NUMA node whose CPUs run rt's device, or -1 when it can't be told.
+// OpenCL says nothing about which cores a sub-device owns, so a native
+// kernel is run on it a few times and asked where it is; the answer only
+// counts when every run lands on the same node.
+int oclDeviceNode(OclRuntime* rt)
+{
+    cl_device_exec_capabilities caps = 0;
+    int samples[4];
+    int* out;
+    int i;
+    clGetDeviceInfo(rt->device, CL_DEVICE_EXECUTION_CAPABILITIES,
+            sizeof(caps), &caps, NULL);
+    if (!(caps & CL_EXEC_NATIVE_KERNEL))
+    {
+        return(-1);
+    }
+    for (i = 0; i < 4; i++)
+    {
+        out = &samples[i];
+        if (clEnqueueNativeKernel(rt->queue, node_probe, &out, sizeof(out),
+                    0, NULL, NULL, 0, NULL, NULL) != CL_SUCCESS)
+        {
+            return(-1);
+        }
+    }
+    clFinish(rt->queue);
+    for (i = 0; i < 4; i++)
+    {
+        if (samples[i] < 0 || samples[i] != samples[0])
+        {
+            return(-1);
+        }
+    }
+    return(samples[0]);
+}
+
+// Page aligned host memory. With node >= 0 the pages are bound to that
+// NUMA node before first touch; on kernels without NUMA support the bind
+// fails harmlessly and the memory is ordinary.
+void* oclHostAlloc(size_t bytes, int node)
+{
+    void* ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        printf("Couldn't allocate %lu bytes of host memory\n",
+                (unsigned long) bytes);
+        exit(1);
+    }
+#ifdef SYS_mbind
+    if (node >= 0 && node < 64)
+    {
+        unsigned long nodemask = 1UL << node;
+        // MPOL_BIND is 2
+        syscall(SYS_mbind, ptr, bytes, 2, &nodemask, 64, 0);
+    }
+#endif
+    return(ptr);
+}
+
+void oclHostFree(void* ptr, size_t bytes)
+{
+    munmap(ptr, bytes);
+}
+
+// A buffer of size bytes holding the first host_size bytes of host (none
+// for CL_MEM_WRITE_ONLY buffers). With zero copy, host memory of exactly
+// the right size and alignment is used in place; anything else goes into
+// driver allocated host memory through a map. Otherwise the data is
+// written on the main queue as usual.
+cl_mem oclBuffer(OclRuntime* rt, cl_mem_flags flags, size_t size, void* host,
+        size_t host_size)
+{
+    cl_int status;
+    cl_mem buf;
+    int upload = (host != NULL && host_size > 0 && !(flags & CL_MEM_WRITE_ONLY));
+    if (!rt->zero_copy)
+    {
+        buf = clCreateBuffer(rt->context, flags, size, NULL, &status);
+        ocl_check(status, "clCreateBuffer");
+        if (upload)
+        {
+            status = clEnqueueWriteBuffer(rt->queue, buf, CL_FALSE, 0,
+                    host_size, host, 0, NULL, NULL);
+            ocl_check(status, "clEnqueueWriteBuffer");
+        }
+        return(buf);
+    }
+
+    if (host != NULL && host_size == size &&
+            ((size_t) host % (rt->base_align > 0 ? rt->base_align : 1)) == 0)
+    {
+        buf = clCreateBuffer(rt->context, flags | CL_MEM_USE_HOST_PTR, size,
+                host, &status);
+        ocl_check(status, "clCreateBuffer");
+        return(buf);
+    }
+    buf = clCreateBuffer(rt->context, flags | CL_MEM_ALLOC_HOST_PTR, size,
+            NULL, &status);
+    ocl_check(status, "clCreateBuffer");
+    if (upload)
+    {
+        void* p = clEnqueueMapBuffer(rt->queue, buf, CL_TRUE, CL_MAP_WRITE,
+                0, size, 0, NULL, NULL, &status);
+        ocl_check(status, "clEnqueueMapBuffer");
+        memcpy(p, host, host_size);
+        memset((char*) p + host_size, 0, size - host_size);
+        status = clEnqueueUnmapMemObject(rt->queue, buf, p, 0, NULL, NULL);
+        ocl_check(status, "clEnqueueUnmapMemObject");
+    }
+    return(buf);
+}
+
+// Blocking read of the first size bytes of buf into host. A zero copy
+// buffer is mapped; when it wraps host already there is nothing to copy.
+void oclReadBuffer(OclRuntime* rt, cl_mem buf, size_t size, void* host)
+{
+    cl_int status;
+    cl_event unmapped;
+    if (!rt->zero_copy)
+    {
+        status = clEnqueueReadBuffer(rt->queue, buf, CL_TRUE, 0, size, host,
+                0, NULL, NULL);
+        ocl_check(status, "clEnqueueReadBuffer");
+        return;
+    }
+    void* p = clEnqueueMapBuffer(rt->queue, buf, CL_TRUE, CL_MAP_READ, 0,
+            size, 0, NULL, NULL, &status);
+    ocl_check(status, "clEnqueueMapBuffer");
+    if (p != host)
+    {
+        memcpy(host, p, size);
+    }
+    status = clEnqueueUnmapMemObject(rt->queue, buf, p, 0, NULL, &unmapped);
+    ocl_check(status, "clEnqueueUnmapMemObject");
+    clWaitForEvents(1, &unmapped);
+    clReleaseEvent(unmapped);
+}
+
+// Queue idx on the runtime's device: 0 is the main queue, others are extra
+// in-order profiling queues created on first use so transfers and kernels
+// can run concurrently.
+cl_command_queue oclQueue(OclRuntime* rt, int idx)
+{
+    cl_int status;
+    if (idx == 0)
+    {
+        return(rt->queue);
+    }
+    if (idx > OCL_MAX_QUEUES)
+    {
+        printf("Only %d extra queues are available\n", OCL_MAX_QUEUES);
+        exit(1);
+    }
+    if (rt->extra_queues[idx - 1] == NULL)
+    {
+        rt->extra_queues[idx - 1] = clCreateCommandQueue(rt->context,
+                rt->device, CL_QUEUE_PROFILING_ENABLE, &status);
+        ocl_check(status, "clCreateCommandQueue");
+    }
+    return(rt->extra_queues[idx - 1]);
+}
+
+// 64 bit FNV-1a, chainable by passing the previous result as hash.
+unsigned long long oclHash(unsigned long long hash, const void* data, size_t len)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t i;
+    if (hash == 0)
+    {
+        hash = 14695981039346656037ULL;
+    }
+    for (i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return(hash);
+}
+
+static void print_build_log(cl_program program, cl_device_id dev)
+{
+    size_t log_size;
+    char* program_log;
+    clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL,
+            &log_size);
+    program_log = (char*) malloc(log_size + 1);
+    program_log[log_size] = '\0';
+    clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
+            log_size + 1, program_log, NULL);
+    printf("%s\n", program_log);
+    free(program_log);
+}
+
+// On-disk program binaries. Each file in the cache directory holds
+//   "OCLB", key length, key, binary length, binary
+// where the key names the device, driver version, build options and source
+// hash. The file name is a hash of the key; the stored key guards against
+// collisions and stale entries.
+static const char* cache_dir()
+{
+    const char* dir = getenv("OCL_CACHE_DIR");
+    if (dir == NULL)
+    {
+        dir = OCL_DEFAULT_CACHE_DIR;
+    }
+    return(dir);
+}
+
+static char* cache_key(OclRuntime* rt, unsigned long long srchash,
+        size_t len, const char* options)
+{
+    size_t keylen = strlen(rt->device_name) + strlen(rt->driver_version) +
+        strlen(options) + 64;
+    char* key = (char*) malloc(keylen);
+    snprintf(key, keylen, "%s\n%s\n%s\n%016llx:%lu", rt->device_name,
+            rt->driver_version, options, srchash, (unsigned long) len);
+    return(key);
+}
+
+static void cache_file(const char* key, char* path, size_t pathlen)
+{
+    snprintf(path, pathlen, "%s/%016llx.bin", cache_dir(),
+            oclHash(0, key, strlen(key)));
+}
+
+// Returns a built program from the cache, or NULL on any mismatch.
+static cl_program load_cached_program(OclRuntime* rt, const char* key,
+        const char* options)
+{
+    char path[1024];
+    char magic[4];
+    unsigned int keylen;
+    unsigned long long binsize;
+    char* stored_key;
+    unsigned char* binary;
+    cl_program program;
+    cl_int err, binary_status;
+    FILE* fp;
+    size_t size;
+
+    cache_file(key, path, sizeof(path));
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return(NULL);
+    }
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "OCLB", 4) != 0 ||
+            fread(&keylen, sizeof(keylen), 1, fp) != 1 ||
+            keylen != strlen(key))
+    {
+        fclose(fp);
+        return(NULL);
+    }
+    stored_key = (char*) malloc(keylen);
+    if (fread(stored_key, 1, keylen, fp) != keylen ||
+            memcmp(stored_key, key, keylen) != 0 ||
+            fread(&binsize, sizeof(binsize), 1, fp) != 1)
+    {
+        free(stored_key);
+        fclose(fp);
+        return(NULL);
+    }
+    free(stored_key);
+    // The binary runs to the end of the file; a size field that says
+    // otherwise comes from a damaged file.
+    long start = ftell(fp);
+    if (start < 0 || fseek(fp, 0, SEEK_END) != 0 ||
+            binsize != (unsigned long long) (ftell(fp) - start) ||
+            fseek(fp, start, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return(NULL);
+    }
+    binary = (unsigned char*) malloc(binsize);
+    if (fread(binary, 1, binsize, fp) != binsize)
+    {
+        free(binary);
+        fclose(fp);
+        return(NULL);
+    }
+    fclose(fp);
+
+    size = binsize;
+    program = clCreateProgramWithBinary(rt->context, 1, &rt->device, &size,
+            (const unsigned char**) &binary, &binary_status, &err);
+    free(binary);
+    if (err != CL_SUCCESS || binary_status != CL_SUCCESS)
+    {
+        if (program != NULL && err == CL_SUCCESS)
+        {
+            clReleaseProgram(program);
+        }
+        return(NULL);
+    }
+    if (clBuildProgram(program, 1, &rt->device, options, NULL, NULL)
+            != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return(NULL);
+    }
+    return(program);
+}
+
+// The file is written under a temporary name and renamed into place, so
+// jobs sharing the cache never see a partial binary.
+static void store_cached_program(const char* key, cl_program program)
+{
+    char path[1024], tmpname[1024];
+    int fd, ok;
+    size_t binsize;
+    unsigned long long size64;
+    unsigned int keylen = strlen(key);
+    unsigned char* binary;
+    FILE* fp;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binsize),
+                &binsize, NULL) != CL_SUCCESS || binsize == 0)
+    {
+        return;
+    }
+    binary = (unsigned char*) malloc(binsize);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary),
+                &binary, NULL) != CL_SUCCESS)
+    {
+        free(binary);
+        return;
+    }
+
+    mkdir(cache_dir(), 0755);
+    cache_file(key, path, sizeof(path));
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", path);
+    fd = mkstemp(tmpname);
+    if (fd >= 0)
+    {
+        fchmod(fd, 0644);
+    }
+    fp = (fd >= 0 ? fdopen(fd, "wb") : NULL);
+    if (fp == NULL)
+    {
+        printf("Couldn't write program cache file %s\n", path);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmpname);
+        }
+        free(binary);
+        return;
+    }
+    size64 = binsize;
+    ok = fwrite("OCLB", 1, 4, fp) == 4 &&
+        fwrite(&keylen, sizeof(keylen), 1, fp) == 1 &&
+        fwrite(key, 1, keylen, fp) == keylen &&
+        fwrite(&size64, sizeof(size64), 1, fp) == 1 &&
+        fwrite(binary, 1, binsize, fp) == binsize;
+    if (fclose(fp) != 0 || !ok || rename(tmpname, path) != 0)
+    {
+        printf("Couldn't write program cache file %s\n", path);
+        unlink(tmpname);
+    }
+    free(binary);
+}
+
+// Build source with options, or return the program already built from the
+// same source and options.
+cl_program oclGetProgram(OclRuntime* rt, const char* source, size_t len,
+        const char* options)
+{
+    cl_int err;
+    int i;
+    unsigned long long hash;
+    OclProgramEntry* entry;
+    if (options == NULL)
+    {
+        options = "";
+    }
+    hash = oclHash(0, source, len);
+    hash = oclHash(hash, options, strlen(options));
+    for (i = 0; i < rt->num_programs; i++)
+    {
+        entry = &rt->programs[i];
+        if (entry->hash == hash && entry->source_len == len &&
+                strcmp(entry->options, options) == 0)
+        {
+            return(entry->program);
+        }
+    }
+    if (rt->num_programs == OCL_MAX_PROGRAMS)
+    {
+        printf("Program cache is full (%d programs)\n", OCL_MAX_PROGRAMS);
+        exit(1);
+    }
+
+    cl_program program = NULL;
+    char* key = NULL;
+    int use_disk = (cache_dir()[0] != '\0');
+    if (use_disk)
+    {
+        key = cache_key(rt, oclHash(0, source, len), len, options);
+        program = load_cached_program(rt, key, options);
+        if (program != NULL)
+        {
+            rt->cache_hits++;
+            fprintf(stderr, "Program binary cache hit (%d hits, %d misses)\n",
+                    rt->cache_hits, rt->cache_misses);
+        }
+        else
+        {
+            rt->cache_misses++;
+            fprintf(stderr, "Program binary cache miss (%d hits, %d misses)\n",
+                    rt->cache_hits, rt->cache_misses);
+        }
+    }
+
+    if (program == NULL)
+    {
+        program = clCreateProgramWithSource(rt->context, 1, &source, &len,
+                &err);
+        if (err < 0)
+        {
+            perror("Couldn't Create Program");
+            exit(1);
+        }
+        err = clBuildProgram(program, 1, &rt->device, options, NULL, NULL);
+        if (err < 0)
+        {
+            print_build_log(program, rt->device);
+            exit(1);
+        }
+        if (use_disk)
+        {
+            store_cached_program(key, program);
+        }
+    }
+    free(key);
+
+    entry = &rt->programs[rt->num_programs++];
+    entry->hash = hash;
+    entry->source_len = len;
+    entry->options = strdup(options);
+    entry->program = program;
+    entry->num_kernels = 0;
+    return(program);
+}
+
+// Create the named kernel once per program and hand back the same object
+// on later calls. Kernel arguments persist, so callers must set all of them.
+cl_kernel oclGetKernel(OclRuntime* rt, cl_program program, const char* name)
+{
+    cl_int status;
+    int i, k;
+    for (i = 0; i < rt->num_programs; i++)
+    {
+        OclProgramEntry* entry = &rt->programs[i];
+        if (entry->program != program)
+        {
+            continue;
+        }
+        for (k = 0; k < entry->num_kernels; k++)
+        {
+            if (strcmp(entry->kernel_names[k], name) == 0)
+            {
+                return(entry->kernels[k]);
+            }
+        }
+        if (entry->num_kernels == OCL_MAX_KERNELS)
+        {
+            printf("Kernel cache is full for this program\n");
+            exit(1);
+        }
+        entry->kernels[k] = clCreateKernel(program, name, &status);
+        ocl_check(status, "clCreateKernel");
+        entry->kernel_names[k] = strdup(name);
+        entry->num_kernels++;
+        return(entry->kernels[k]);
+    }
+    printf("Program was not built through the runtime\n");
+    exit(1);
+}
+
+cl_program build_program(OclRuntime* rt, const char* filename,
+        const char* options)
+{
+    FILE *program_handle;
+    char *program_buffer;
+    size_t program_size;
+    cl_program program;
+    /*Read in program*/
+    program_handle = fopen(filename, "r");
+    if (program_handle == NULL)
+    {
+        perror("Couldn't find the program file");
+        exit(1);
+    }
+    fseek(program_handle, 0, SEEK_END);
+    program_size = ftell(program_handle);
+    rewind(program_handle);
+    program_buffer = (char*) malloc(program_size + 1);
+    program_buffer[program_size] = '\0';
+    program_size = fread(program_buffer, sizeof(char), program_size,
+            program_handle);
+    fclose(program_handle);
+
+    program = oclGetProgram(rt, program_buffer, program_size, options);
+    free(program_buffer);
+    return(program);
+}
+
+typedef struct
+{
+    cl_ulong start;
+    cl_ulong end;
+} OclInterval;
+
+static int compare_interval(const void* a, const void* b)
+{
+    cl_ulong sa = ((const OclInterval*) a)->start;
+    cl_ulong sb = ((const OclInterval*) b)->start;
+    return(sa < sb ? -1 : (sa > sb ? 1 : 0));
+}
+
+// Print when each profiled command ran, relative to the first one, and how
+// much of the transfer time was hidden behind kernels. The overlap is the
+// summed busy time minus the time at least one command was running.
+void oclReportTimeline(const cl_event* events, const int* kinds, int n)
+{
+    const char* names[3] = {"write", "kernel", "read"};
+    OclInterval* iv = (OclInterval*) malloc(n*sizeof(OclInterval));
+    double busy[3] = {0.0, 0.0, 0.0};
+    cl_ulong t0 = 0, t_end = 0, covered = 0, cur_start, cur_end;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START,
+                sizeof(cl_ulong), &iv[i].start, NULL);
+        clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END,
+                sizeof(cl_ulong), &iv[i].end, NULL);
+        if (i == 0 || iv[i].start < t0) t0 = iv[i].start;
+        if (iv[i].end > t_end) t_end = iv[i].end;
+        busy[kinds[i]] += (iv[i].end - iv[i].start)*1e-6;
+    }
+    printf("Timeline (ms from first command):\n");
+    for (i = 0; i < n; i++)
+    {
+        printf("  %-6s %9.3lf - %9.3lf\n", names[kinds[i]],
+                (iv[i].start - t0)*1e-6, (iv[i].end - t0)*1e-6);
+    }
+
+    qsort(iv, n, sizeof(OclInterval), compare_interval);
+    cur_start = iv[0].start;
+    cur_end = iv[0].end;
+    for (i = 1; i < n; i++)
+    {
+        if (iv[i].start > cur_end)
+        {
+            covered += cur_end - cur_start;
+            cur_start = iv[i].start;
+        }
+        if (iv[i].end > cur_end) cur_end = iv[i].end;
+    }
+    covered += cur_end - cur_start;
+    free(iv);
+
+    double transfer = busy[OCL_EVENT_WRITE] + busy[OCL_EVENT_READ];
+    double overlap = busy[0] + busy[1] + busy[2] - covered*1e-6;
+    printf("Span %.3lf ms: write %.3lf ms, kernel %.3lf ms, read %.3lf ms\n",
+            (t_end - t0)*1e-6, busy[0], busy[1], busy[2]);
+    printf("Overlap %.3lf ms (%.0lf%% of transfer time hidden)\n", overlap,
+            transfer > 0 ? 100.0*overlap/transfer : 0.0);
+}
@@ -0,0 +1,81 @@
+#ifndef CLRUNTIME_H
+#define CLRUNTIME_H
+
+#include <stddef.h>
+#include <CL/cl.h>
+
+#define OCL_MAX_PROGRAMS 32
+#define OCL_MAX_KERNELS 8
+#define OCL_MAX_QUEUES 4
+#define OCL_MAX_DEVICES 16
+// Compiled program binaries are kept here unless OCL_CACHE_DIR says
+// otherwise; an empty OCL_CACHE_DIR disables the on-disk cache.
+#define OCL_DEFAULT_CACHE_DIR "./.oclcache"
+
+// A built program, identified by the hash of its source and build options,
+// together with the kernels created from it so far.
+typedef struct
+{
+    unsigned long long hash;
+    size_t source_len;
+    char* options;
+    cl_program program;
+    int num_kernels;
+    char* kernel_names[OCL_MAX_KERNELS];
+    cl_kernel kernels[OCL_MAX_KERNELS];
+} OclProgramEntry;
+
+// Platform, device, context and profiling queue set up once, plus every
+// program built through it. Repeated calls only pay for transfers and
+// kernel time. oclRuntime() is the process wide one on the default device;
+// oclRuntimeForDevice makes one per device for multi-device work.
+typedef struct
+{
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_command_queue extra_queues[OCL_MAX_QUEUES];
+    char device_name[256];
+    char driver_version[128];
+    // Host and device share memory (or OCL_ZERO_COPY=1): buffers wrap host
+    // memory and are mapped instead of copied.
+    int zero_copy;
+    cl_uint base_align;
+    int cache_hits;
+    int cache_misses;
+    int num_programs;
+    OclProgramEntry programs[OCL_MAX_PROGRAMS];
+} OclRuntime;
+
+cl_device_id create_device();
+int oclDeviceAvailable();
+double walltime();
+
+OclRuntime* oclRuntime();
+void oclReleaseRuntime();
+OclRuntime* oclRuntimeForDevice(cl_device_id dev);
+void oclFreeRuntime(OclRuntime* rt);
+int oclListDevices(cl_device_id* devs, int max_devs, int split);
+int oclNumaDevices(cl_device_id dev, cl_device_id* subs, int max_subs);
+int oclDeviceNode(OclRuntime* rt);
+void* oclHostAlloc(size_t bytes, int node);
+void oclHostFree(void* ptr, size_t bytes);
+cl_command_queue oclQueue(OclRuntime* rt, int idx);
+cl_mem oclBuffer(OclRuntime* rt, cl_mem_flags flags, size_t size, void* host,
+        size_t host_size);
+void oclReadBuffer(OclRuntime* rt, cl_mem buf, size_t size, void* host);
+unsigned long long oclHash(unsigned long long hash, const void* data, size_t len);
+cl_program oclGetProgram(OclRuntime* rt, const char* source, size_t len,
+        const char* options);
+cl_kernel oclGetKernel(OclRuntime* rt, cl_program program, const char* name);
+cl_program build_program(OclRuntime* rt, const char* filename,
+        const char* options);
+
+// Event kinds for oclReportTimeline
+#define OCL_EVENT_WRITE 0
+#define OCL_EVENT_KERNEL 1
+#define OCL_EVENT_READ 2
+void oclReportTimeline(const cl_event* events, const int* kinds, int n);
+
+#endif
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+#include "matrixio.h"
+#include "cpugemm.h"
+
+#define MR CPU_GEMM_MR
+#define NR CPU_GEMM_NR
+#define KC CPU_GEMM_KC
+#define MC CPU_GEMM_MC
+#define NC CPU_GEMM_NC
+#define MB CPU_GEMM_MB
+
+// One thread's share of C = A*B: rows row0 .. row0 + rows - 1. Element
+// (i, j) of X is at i*rsX + j*csX.
+typedef struct
+{
+    int dtype;
+    void* C;
+    int rsC, csC;
+    const void* A;
+    int rsA, csA;
+    const void* B;
+    int rsB, csB;
+    int K, N;
+    int row0, rows;
+} GemmTask;
+
+static double loadValue(const void* p, size_t i, int dtype)
+{
+    return(dtype == MATRIX_DOUBLE ? ((const double*) p)[i]
+            : ((const float*) p)[i]);
+}
+
+static void* allocAligned(size_t bytes)
+{
+    void* p = NULL;
+    if (posix_memalign(&p, 64, bytes) != 0)
+    {
+        printf("Error allocating GEMM workspace\n");
+        exit(-1);
+    }
+    return(p);
+}
+
+int cpuGemmThreads()
+{
+    static int threads = 0;
+    if (threads == 0)
+    {
+        const char* env = getenv("CPU_GEMM_THREADS");
+        threads = (env != NULL ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN));
+        if (threads < 1)
+        {
+            threads = 1;
+        }
+    }
+    return(threads);
+}
+
+const char* cpuGemmIsa()
+{
+#if defined(__AVX512F__)
+    return("avx512");
+#elif defined(__AVX2__) && defined(__FMA__)
+    return("avx2");
+#else
+    return("portable");
+#endif
+}
+
+// mc x kc block of A at (i0, p0) as MR-row slivers, each stored k by k;
+// the last sliver is padded with zeros.
+static void packA(double* dst, const GemmTask* t, int i0, int mc, int p0,
+        int kc)
+{
+    int s, p, r;
+    for (s = 0; s < mc; s += MR)
+    {
+        for (p = 0; p < kc; p++)
+        {
+            for (r = 0; r < MR; r++)
+            {
+                *dst++ = (s + r < mc ? loadValue(t->A,
+                    (size_t) (i0 + s + r)*t->rsA + (size_t) (p0 + p)*t->csA,
+                    t->dtype) : 0.0);
+            }
+        }
+    }
+}
+
+// kc x nc block of B at (p0, j0) as NR-column slivers, each stored k by k.
+static void packB(double* dst, const GemmTask* t, int p0, int kc, int j0,
+        int nc)
+{
+    int s, p, c;
+    for (s = 0; s < nc; s += NR)
+    {
+        for (p = 0; p < kc; p++)
+        {
+            for (c = 0; c < NR; c++)
+            {
+                *dst++ = (s + c < nc ? loadValue(t->B,
+                    (size_t) (p0 + p)*t->rsB + (size_t) (j0 + s + c)*t->csB,
+                    t->dtype) : 0.0);
+            }
+        }
+    }
+}
+
+// c[MR x NR] (row pitch ldc) += a sliver times b sliver over kc.
+static void microKernel(int kc, const double* a, const double* b, double* c,
+        int ldc)
+{
+    int p;
+#if defined(__AVX512F__)
+    __m512d c0 = _mm512_loadu_pd(c);
+    __m512d c1 = _mm512_loadu_pd(c + ldc);
+    __m512d c2 = _mm512_loadu_pd(c + 2*ldc);
+    __m512d c3 = _mm512_loadu_pd(c + 3*ldc);
+    for (p = 0; p < kc; p++, a += MR, b += NR)
+    {
+        __m512d bv = _mm512_load_pd(b);
+        c0 = _mm512_fmadd_pd(_mm512_set1_pd(a[0]), bv, c0);
+        c1 = _mm512_fmadd_pd(_mm512_set1_pd(a[1]), bv, c1);
+        c2 = _mm512_fmadd_pd(_mm512_set1_pd(a[2]), bv, c2);
+        c3 = _mm512_fmadd_pd(_mm512_set1_pd(a[3]), bv, c3);
+    }
+    _mm512_storeu_pd(c, c0);
+    _mm512_storeu_pd(c + ldc, c1);
+    _mm512_storeu_pd(c + 2*ldc, c2);
+    _mm512_storeu_pd(c + 3*ldc, c3);
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256d c00 = _mm256_loadu_pd(c), c01 = _mm256_loadu_pd(c + 4);
+    __m256d c10 = _mm256_loadu_pd(c + ldc), c11 = _mm256_loadu_pd(c + ldc + 4);
+    __m256d c20 = _mm256_loadu_pd(c + 2*ldc), c21 = _mm256_loadu_pd(c + 2*ldc + 4);
+    __m256d c30 = _mm256_loadu_pd(c + 3*ldc), c31 = _mm256_loadu_pd(c + 3*ldc + 4);
+    for (p = 0; p < kc; p++, a += MR, b += NR)
+    {
+        __m256d b0 = _mm256_load_pd(b), b1 = _mm256_load_pd(b + 4);
+        __m256d av = _mm256_broadcast_sd(a);
+        c00 = _mm256_fmadd_pd(av, b0, c00);
+        c01 = _mm256_fmadd_pd(av, b1, c01);
+        av = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(av, b0, c10);
+        c11 = _mm256_fmadd_pd(av, b1, c11);
+        av = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(av, b0, c20);
+        c21 = _mm256_fmadd_pd(av, b1, c21);
+        av = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(av, b0, c30);
+        c31 = _mm256_fmadd_pd(av, b1, c31);
+    }
+    _mm256_storeu_pd(c, c00); _mm256_storeu_pd(c + 4, c01);
+    _mm256_storeu_pd(c + ldc, c10); _mm256_storeu_pd(c + ldc + 4, c11);
+    _mm256_storeu_pd(c + 2*ldc, c20); _mm256_storeu_pd(c + 2*ldc + 4, c21);
+    _mm256_storeu_pd(c + 3*ldc, c30); _mm256_storeu_pd(c + 3*ldc + 4, c31);
+#else
+    // Fixed trip counts over a local tile, which compilers vectorize
+    int i, j;
+    double acc[MR][NR];
+    for (i = 0; i < MR; i++)
+    {
+        for (j = 0; j < NR; j++)
+        {
+            acc[i][j] = c[i*ldc + j];
+        }
+    }
+    for (p = 0; p < kc; p++, a += MR, b += NR)
+    {
+        for (i = 0; i < MR; i++)
+        {
+            for (j = 0; j < NR; j++)
+            {
+                acc[i][j] += a[i]*b[j];
+            }
+        }
+    }
+    for (i = 0; i < MR; i++)
+    {
+        for (j = 0; j < NR; j++)
+        {
+            c[i*ldc + j] = acc[i][j];
+        }
+    }
+#endif
+}
+
+// The rows of C owned by one task, in bands of at most MB rows and column
+// panel by column panel. Each band's panel is accumulated in a double
+// workspace over all of K and only then stored in C's type and layout.
+static void* gemmTask(void* arg)
+{
+    const GemmTask* t = (const GemmTask*) arg;
+    double* Ap = allocAligned(sizeof(double)*MC*KC);
+    double* Bp = allocAligned(sizeof(double)*KC*NC);
+    double* Cw = allocAligned(sizeof(double)*MB*NC);
+    int mb, jc, pc, ic, jr, ir, i, j;
+
+    for (mb = 0; mb < t->rows; mb += MB)
+    {
+        int rows = (t->rows - mb < MB ? t->rows - mb : MB);
+        for (jc = 0; jc < t->N; jc += NC)
+        {
+            int nc = (t->N - jc < NC ? t->N - jc : NC);
+            memset(Cw, 0, sizeof(double)*MB*NC);
+            for (pc = 0; pc < t->K; pc += KC)
+            {
+                int kc = (t->K - pc < KC ? t->K - pc : KC);
+                packB(Bp, t, pc, kc, jc, nc);
+                for (ic = 0; ic < rows; ic += MC)
+                {
+                    int mc = (rows - ic < MC ? rows - ic : MC);
+                    packA(Ap, t, t->row0 + mb + ic, mc, pc, kc);
+                    for (jr = 0; jr < nc; jr += NR)
+                    {
+                        for (ir = 0; ir < mc; ir += MR)
+                        {
+                            microKernel(kc, Ap + (size_t) ir*kc,
+                                    Bp + (size_t) jr*kc,
+                                    Cw + (size_t) (ic + ir)*NC + jr, NC);
+                        }
+                    }
+                }
+            }
+            for (i = 0; i < rows; i++)
+            {
+                for (j = 0; j < nc; j++)
+                {
+                    size_t idx = (size_t) (t->row0 + mb + i)*t->rsC +
+                        (size_t) (jc + j)*t->csC;
+                    double v = Cw[(size_t) i*NC + j];
+                    if (t->dtype == MATRIX_DOUBLE)
+                    {
+                        ((double*) t->C)[idx] = v;
+                    }
+                    else
+                    {
+                        ((float*) t->C)[idx] = (float) v;
+                    }
+                }
+            }
+        }
+    }
+    free(Ap);
+    free(Bp);
+    free(Cw);
+    return(NULL);
+}
+
+// C = A*B for M x K and K x N operands of element type dtype (MATRIX_FLOAT
+// or MATRIX_DOUBLE), element (i, j) of X at i*rsX + j*csX. The rows of C
+// are split over cpuGemmThreads() threads; the calling thread takes the
+// first share.
+void cpuGemm(int dtype, void* C, int rsC, int csC, const void* A, int rsA,
+        int csA, const void* B, int rsB, int csB, int M, int K, int N)
+{
+    int t, threads = cpuGemmThreads();
+    if ((double) M*K*N < CPU_GEMM_MIN_PARALLEL)
+    {
+        threads = 1;
+    }
+    // whole register tiles per thread
+    int slivers = (M + MR - 1)/MR;
+    if (threads > slivers)
+    {
+        threads = (slivers > 0 ? slivers : 1);
+    }
+    GemmTask* tasks = malloc(sizeof(GemmTask)*threads);
+    pthread_t* ids = malloc(sizeof(pthread_t)*threads);
+    int row = 0;
+    for (t = 0; t < threads; t++)
+    {
+        int share = ((slivers*(t + 1))/threads)*MR;
+        GemmTask task = {dtype, C, rsC, csC, A, rsA, csA, B, rsB, csB, K, N,
+            row, (share < M ? share : M) - row};
+        tasks[t] = task;
+        row += tasks[t].rows;
+    }
+    for (t = 1; t < threads; t++)
+    {
+        if (pthread_create(&ids[t], NULL, gemmTask, &tasks[t]) != 0)
+        {
+            printf("Error starting GEMM thread\n");
+            exit(-1);
+        }
+    }
+    gemmTask(&tasks[0]);
+    for (t = 1; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+    }
+    free(tasks);
+    free(ids);
+}
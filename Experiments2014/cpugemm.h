@@ -0,0 +1,25 @@
+#ifndef CPUGEMM_H
+#define CPUGEMM_H
+
+// Host GEMM used as the correctness reference and as the fallback when no
+// OpenCL device is present. C is produced in MR x NR register tiles from
+// KC deep panels of A (MC rows) and B (NC columns) packed into contiguous
+// double buffers, so any storage order and either element type run the
+// same inner kernel. Sums are carried in double.
+#define CPU_GEMM_MR 4
+#define CPU_GEMM_NR 8
+#define CPU_GEMM_KC 256
+#define CPU_GEMM_MC 64
+#define CPU_GEMM_NC 1024
+// Rows of C accumulated at once, which bounds the per-thread workspace to
+// MB x NC doubles; B panels are repacked once per band
+#define CPU_GEMM_MB 512
+// Products smaller than this many multiply-adds stay on one thread
+#define CPU_GEMM_MIN_PARALLEL (64*64*64)
+
+int cpuGemmThreads();
+const char* cpuGemmIsa();
+void cpuGemm(int dtype, void* C, int rsC, int csC, const void* A, int rsA,
+        int csA, const void* B, int rsB, int csB, int M, int K, int N);
+
+#endif
@@ -2,7 +2,7 @@
 //What does this do?
 #define NUM_KERNELS 1
 #define PROGRAM_FILE "./matmult_partitioning.kernel"
-#define PROGRAM_FILE_fp64 "./matmult_partitioning_fp64.kernel"
+#define SPARSE_PROGRAM_FILE "./sparse.kernel"
 
 
 #include <math.h>
@@ -11,258 +11,243 @@
 #include <string.h>
 #include <time.h>
 #include <CL/cl.h>
+#include "clruntime.h"
+#include "cpugemm.h"
+#include "matrixio.h"
+#include "sparse.h"
+#include "tuning.h"
+#include "verify.h"
+
+// Input matrices, either text or binary (see matrixio.h)
+char* Afile = "A.txt";
+char* Bfile = "B.txt";
+// Number of times to repeat the OpenCL multiply (-repeat N)
+int repeat = 1;
+// Kernel configuration from -kernel tiled|regblock, -ls N (or -ls XxY for
+// a tiled work-group X wide and Y high) and -wpt 4|8.
+// Without any of those the tuning database is consulted.
+MatmultConfig config = {"tiled", 0, 4, 0};
+int config_given = 0;
+// Sweep kernel configurations and record the fastest (-tune)
+int tune = 0;
+// Device memory budget in bytes for out-of-core multiplies (-budget N[KMG]).
+// 0 streams only when the matrices would not fit on the device.
+size_t budget = 0;
+// Row panels for the pipelined transfer/compute mode (-pipeline N)
+int pipeline = 0;
+// Split rows of C over every device (-multidevice), optionally partitioning
+// each device into N equal sub-devices first (-split N)
+int multidevice = 0;
+int split = 0;
+// Split the default device into one sub-device per NUMA node, each with
+// host buffers on its own node when that node can be found (-numa)
+int numa = 0;
+
+// Element types the engine can run. The kernels are built from one source
+// with the precision's defines, and the name keys the tuning database.
+// "mixed" stores float but accumulates in double; "kahan" stores and
+// accumulates float with compensated sums, for devices without fp64.
+typedef struct
+{
+    const char* name;
+    int dtype;          // matrixio element type
+    size_t elsize;
+    const char* options;
+    int needs_fp64;
+} Precision;
+
+const Precision precisions[] = {
+    {"fp32", MATRIX_FLOAT, sizeof(float), "-DREAL=float", 0},
+    {"fp64", MATRIX_DOUBLE, sizeof(double), "-DREAL=double -DFP_64=1", 1},
+    {"mixed", MATRIX_FLOAT, sizeof(float), "-DREAL=float -DACC=double -DFP_64=1", 1},
+    {"kahan", MATRIX_FLOAT, sizeof(float), "-DREAL=float -DKAHAN=1", 0},
+};
+#define NUM_PRECISIONS (sizeof(precisions)/sizeof(precisions[0]))
+// Products of M rows each stacked in the input files, multiplied in one
+// launch (-batch M)
+int batch = 0;
+// Fused epilogue C = act(alpha*A*B + beta*C + bias) of the single-device
+// multiply (-alpha, -beta, -bias, -activation relu|exp|log). C starts from
+// -cfile when given, zeros otherwise.
+typedef struct
+{
+    double alpha;
+    double beta;
+    double bias;
+    int has_bias;
+    char activation[8];
+} Epilogue;
+Epilogue epilogue = {1.0, 0.0, 0.0, 0, ""};
+char* Cfile = NULL;
+// Operand layout of the single-device multiply: A and/or B stored
+// transposed (-transA, -transB), and all three matrices column-major as R
+// keeps them (-colmajor). Nothing is transposed on the host or device.
+int transA = 0;
+int transB = 0;
+int colmajor = 0;
+// Sparse A (-sparse auto|dense|csr|ell): auto runs the CSR or ELL kernels
+// when at most -density of A is nonzero, dense and csr|ell force a path.
+char sparse_mode[8] = "auto";
+double density = SPARSE_DEFAULT_THRESHOLD;
+// Per-call launch details; off while looping over many small products
+int verbose = 1;
+// Multiply with the host GEMM instead of OpenCL (-host), also the fallback
+// when no OpenCL device is found
+int host_only = 0;
+// Result check tolerances and sampling (-atol, -rtol, -ulps, -sample,
+// -offenders), see verify.h
+VerifyOptions vopts;
+// -precision fp32|fp64|mixed|kahan; by default fp64 when the device
+// supports it
+const Precision* prec = NULL;
 
-cl_device_id create_device()
+void stoptime( clock_t start, char msg[] )
 {
-    int err;
-    cl_uint num_platforms;
-    cl_platform_id platforms[100];
-    err = clGetPlatformIDs(100, platforms, &num_platforms);
-    if (err < 0)
+    clock_t end ;
+    double cpu_time_used;
+    end = clock();
+    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+    printf("CPU time used for %s = %.3lf \n", msg, cpu_time_used) ;
+}
+// Element i of a matrix in the current precision, and the reverse.
+double getReal(const void* p, size_t i)
+{
+    if (prec->dtype == MATRIX_DOUBLE)
     {
-        perror("Couldn't identify platform.");
-        exit(1);
+        return(((const double*) p)[i]);
     }
-    printf("%d platforms detected\n", num_platforms); 
-    int pid = 0;
-    printf("Selecting platform id: %d\n", pid);
-    cl_device_id dev;
-    err = clGetDeviceIDs((platforms[pid]), CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
-    printf("Device Retreived");
-    if (err == CL_DEVICE_NOT_FOUND)
+    return(((const float*) p)[i]);
+}
+void setReal(void* p, size_t i, double v)
+{
+    if (prec->dtype == MATRIX_DOUBLE)
     {
-        printf("Couldn't find GPU!\n");
-        err = clGetDeviceIDs(platforms[pid], CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+        ((double*) p)[i] = v;
     }
-    if (err<0)
+    else
     {
-        perror("Couldn't access any devices.\n");
-        exit(1);
+        ((float*) p)[i] = (float) v;
     }
-    return(dev);
+}
+// C = A*B for M x K and K x N operands where element (i, j) of X is at
+// i*rsX + j*csX, which covers row-major, column-major and transposed
+// storage alike. Runs the blocked, multithreaded host GEMM (cpugemm.h).
+void stridedMultiplyCPU(void* C, int rsC, int csC, void* A, int rsA, int csA,
+        void* B, int rsB, int csB, int M, int K, int N)
+{
+    cpuGemm(prec->dtype, C, rsC, csC, A, rsA, csA, B, rsB, csB, M, K, N);
+}
+void simpleMultiplyCPU( void *C, int widthA, int heightA, int widthB,
+    int heightB, void *A, void *B)
+{
+    stridedMultiplyCPU(C, widthB, 1, A, widthA, 1, B, widthB, 1, heightA,
+            widthA, widthB);
 }
 
-
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename, char* definestr, int lendefinestr)
+int epilogueActive()
 {
-    cl_program program;
-    FILE *program_handle;
-    char *program_buffer, *program_log;
-    size_t program_size, log_size;
-    int err;
-    /*Read in program*/
-    program_handle = fopen(filename, "r");
-    if (program_handle == NULL)
-    {
-        perror("Couldn't find the program file");
-        exit(1);
+    return(epilogue.alpha != 1.0 || epilogue.beta != 0.0 ||
+            epilogue.has_bias || epilogue.activation[0] != '\0');
+}
+// Kernel defines selecting the epilogue, appended to options.
+void epilogueOptions(char* options)
+{
+    if (epilogue.alpha != 1.0)
+    {
+        strcat(options, " -DALPHA");
     }
-    fseek(program_handle, 0, SEEK_END);
-    program_size = ftell(program_handle);
-    rewind(program_handle);
-    program_buffer = (char*) malloc(program_size + lendefinestr + 1);
-    program_buffer[program_size] = '\0';
-    fread(program_buffer, sizeof(char), program_size, program_handle);
-
-    int i;
-    for (i = 0; i < lendefinestr; i ++)
+    if (epilogue.beta != 0.0)
     {
-        program_buffer[i] = definestr[i];
+        strcat(options, " -DBETA");
     }
-    //printf("%s", program_buffer);
-    fclose(program_handle);
-
-
-    program = clCreateProgramWithSource(ctx,1, 
-            (const char**)&program_buffer, &program_size, &err);
-    if (err < 0)
+    if (epilogue.has_bias)
     {
-        perror("Couldn't Create Program");
-        exit(1);
+        strcat(options, " -DBIAS");
     }
-    free(program_buffer);
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-    if (err < 0)
+    if (strcmp(epilogue.activation, "relu") == 0)
     {
-        clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL,
-                &log_size);
-        program_log = (char*) malloc(log_size + 1);
-        program_log[log_size] = '\0';
-        clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-                log_size + 1, program_log, NULL);
-        printf("%s\n", program_log);
-        free(program_log);
-        exit(1);
+        strcat(options, " -DACTIVATION_RELU");
     }
-    return(program);
-}
-
-float* padDataMatrix(float* inData, int nrow, int ncol, int padcol, int padrow)
-{
-    float* paddedMatrix = (float*) malloc(sizeof(float)*(nrow + padrow)*(ncol + padcol));
-    int rw = 0;
-    int col = 0;
-    int idx = 0;
-    for (rw = 0; rw < nrow; rw ++)
+    else if (strcmp(epilogue.activation, "exp") == 0)
     {
-        for (col = 0; col < ncol; col ++)
-        {
-            paddedMatrix[idx] = inData[col + rw*ncol];
-            idx += 1;
-        }
-        for (col = 0; col < padcol; col ++)
-        {
-            paddedMatrix[idx] = 0.0;
-            idx += 1;
-        }
+        strcat(options, " -DACTIVATION_EXP");
     }
-    for (rw = 0; rw < padrow; rw ++)
+    else if (strcmp(epilogue.activation, "log") == 0)
     {
-        for (col = 0; col < (ncol + padcol); col ++)
-        {
-            paddedMatrix[idx] = 0.0;
-            idx += 1;
-        }
+        strcat(options, " -DACTIVATION_LOG");
     }
-    return(paddedMatrix);
-}
-
-float* transposeDataMatrix(float* inData, int nrow, int ncol)
-{
-    float* newvector = (float*) malloc(sizeof(float)*nrow*ncol);
-    int rw;
-    int col;
-    int i = 0;
-    for (col = 0; col < ncol; col ++)
+    else if (epilogue.activation[0] != '\0')
     {
-        for (rw = 0; rw < nrow; rw ++)
-        {
-            newvector[i] = inData[rw*ncol + col];
-            i += 1;
-        }
+        printf("Unknown activation %s\n", epilogue.activation);
+        exit(1);
     }
-    return(newvector);
 }
-void stoptime( clock_t start, char msg[] )
+// The same epilogue on the host, for checking: C = act(alpha*AB + beta*C0
+// + bias) elementwise over n values.
+void epilogueCPU(void* C, void* AB, void* C0, size_t n)
 {
-    clock_t end ;
-    double cpu_time_used;
-    end = clock();
-    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-    printf("CPU time used for %s = %.3lf \n", msg, cpu_time_used) ;
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        double v = epilogue.alpha*getReal(AB, i) +
+            epilogue.beta*getReal(C0, i) + epilogue.bias;
+        if (strcmp(epilogue.activation, "relu") == 0) v = (v > 0.0 ? v : 0.0);
+        if (strcmp(epilogue.activation, "exp") == 0) v = exp(v);
+        if (strcmp(epilogue.activation, "log") == 0) v = log(v);
+        setReal(C, i, v);
+    }
 }
-void simpleMultiplyCPU( float *C, int widthA, int heightA, int widthB,
-    int heightB, float *A, float *B)
+
+// C = op(A)*op(B) on the host in the layout given by -transA, -transB and
+// -colmajor, followed by the epilogue when C0 is given. Returns the wall
+// time in seconds.
+double multiply_host(void* C, void* A, void* B, int M, int K, int N, void* C0)
 {
-    int i, j, k;
-    for (i=0; i < heightA; i++)
+    double start = walltime();
+    // Strides of element (i, j) of op(A), op(B) and C in their layouts:
+    // consecutive rows of an operand are adjacent in memory when it is
+    // column-major or transposed, but not both.
+    int a_down = colmajor ^ transA, b_down = colmajor ^ transB;
+    stridedMultiplyCPU(C, colmajor ? 1 : N, colmajor ? M : 1,
+            A, a_down ? 1 : K, a_down ? M : 1,
+            B, b_down ? 1 : N, b_down ? K : 1, M, K, N);
+    if (C0 != NULL)
     {
-        for (j = 0; j<  widthB; j++)
-        {
-            C[i * widthB + j] = 0.0 ;  
-            for( k = 0 ; k < widthA; k++)
-            {
-                C[i * widthB + j] += A[i * widthA + k] * B[k * widthB + j] ;
-            }
-        }
+        epilogueCPU(C, C, C0, (size_t) M*N);
     }
+    return(walltime() - start);
 }
-void simpleMultiplyCPU_fp64( double *C, int widthA, int heightA, int widthB,
-    int heightB, double *A, double *B)
+
+// Only the elements -sample would check (C index s*stride for s < sample)
+// of multiply_host's result, one dot product each, so huge products can be
+// verified without a full host multiply.
+void multiply_host_sampled(void* C, void* A, void* B, int M, int K, int N,
+        void* C0, size_t sample, size_t stride)
 {
-    int i, j, k;
-    for (i=0; i < heightA; i++)
+    int a_down = colmajor ^ transA, b_down = colmajor ^ transB;
+    size_t s;
+    int k;
+    for (s = 0; s < sample; s++)
     {
-        for (j = 0; j<  widthB; j++)
+        size_t idx = s*stride;
+        size_t i = (colmajor ? idx % M : idx / N);
+        size_t j = (colmajor ? idx / M : idx % N);
+        double sum = 0.0;
+        for (k = 0; k < K; k++)
         {
-            C[i * widthB + j] = 0.0 ;  
-            for( k = 0 ; k < widthA; k++)
-            {
-                C[i * widthB + j] += A[i * widthA + k] * B[k * widthB + j] ;
-            }
+            sum += getReal(A, a_down ? i + (size_t) k*M : i*K + k)*
+                getReal(B, b_down ? (size_t) k + j*K : (size_t) k*N + j);
+        }
+        setReal(C, idx, sum);
+        if (C0 != NULL)
+        {
+            epilogueCPU((char*) C + idx*prec->elsize,
+                    (char*) C + idx*prec->elsize,
+                    (char*) C0 + idx*prec->elsize, 1);
         }
     }
 }
 
-float* readDataFile(char fn[], int *mnum, int *nnum ){
-      /* first row of input file contains two ints: num rows and num cols */
-      /* rest of input file is data vals in row major order */
-      int status;
-      int size;
-      float *data;
-      int m,n,i;
-      FILE* fp;
-      fp=fopen(fn,"r");
-      if (!fp)
-      {
-          printf("Error opening file\n");
-      }
-      status = fseek(fp, 0, SEEK_END);
-      if (status != 0)
-      {
-          printf("Error seeking end of file\n");
-          exit(-1);
-      }
-      size = ftell(fp);
-      if (size<0)
-      {
-          printf("Error getting file position\n");
-          exit(-1);
-      }
-
-      rewind(fp);
-
-      fscanf(fp,"%d %d",&m, &n);
-      printf("Rows: %d, Columns:  %d\n", m, n);
-      data=malloc(sizeof(float)*m*n); //
-      for (i=0;i<m*n;i++)
-      fscanf(fp,"%f",&data[i]);
-      fclose(fp);
-      *mnum = m;  // store 'm' where the caller can see it
-      *nnum = n;  // store 'n' where the caller can see it 
-      return(data);
-}
-
-double* readDataFileDouble(char fn[], int *mnum, int *nnum ){
-    
-      /* first row of input file contains two ints: num rows and num cols */
-      /* rest of input file is data vals in row major order */
-      int status;
-      int size;
-      double *data;
-      int m,n,i;
-      FILE* fp;
-      fp=fopen(fn,"r");
-      if (!fp)
-      {
-          printf("Error opening file\n");
-      }
-      status = fseek(fp, 0, SEEK_END);
-      if (status != 0)
-      {
-          printf("Error seeking end of file\n");
-          exit(-1);
-      }
-      size = ftell(fp);
-      if (size<0)
-      {
-          printf("Error getting file position\n");
-          exit(-1);
-      }
-
-      rewind(fp);
-
-      fscanf(fp,"%d %d",&m, &n);
-      printf("Rows: %d, Columns:  %d\n", m, n);
-      data=malloc(sizeof(double)*m*n); //
-      for (i=0;i<m*n;i++)
-      fscanf(fp,"%lf",&data[i]);
-      fclose(fp);
-      *mnum = m;  // store 'm' where the caller can see it
-      *nnum = n;  // store 'n' where the caller can see it 
-      return(data);
-}
-
 void chk(cl_int status, const char* cmd)
 {
     if (status != CL_SUCCESS)
@@ -277,7 +262,7 @@ int supportsDouble()
     cl_int err;
     cl_device_id device;
 
-    device = create_device();
+    device = oclRuntime()->device;
 
     char name_data[48], ext_data[4096];
 
@@ -309,64 +294,47 @@ int supportsDouble()
     return(0);
 }
 
-int main_fp()
+// Multiply A (Arows x Acols) by B (Brows x Bcols) into C on the runtime's
+// device. Everything but the buffers comes from the runtime cache, so only
+// the first call pays for the program build.
+double multiply(OclRuntime* rt, const MatmultConfig* cfg, void* C,
+        void* A, void* B, int Arows, int Acols, int Brows, int Bcols)
 {
-
-    printf("Controll passed to main_fp\n");
-    int i;
     cl_int status;  
      
-    cl_device_id device;
-    cl_context context;
+    cl_device_id device = rt->device;
+    cl_command_queue cmdQueue = rt->queue;
     cl_program program;
     cl_kernel kernel[NUM_KERNELS];
-    cl_command_queue cmdQueue;
+    cl_int err;
+    int i;
+    size_t local_size;
     cl_event prof_event;
-    cl_int j, err, num_groups;
-    size_t local_size, global_size;
+    cl_ulong time_start, time_end;
 
-    char kernel_names[NUM_KERNELS][20] = {"matmult"};
-    int BLOCKSIZE; 
-    device = create_device();
-    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,sizeof(local_size),
-            &local_size, NULL);
-    printf("Max work group size: %d\n", (int) local_size);
+    clock_t start;
 
-    if (err < 0)
+    // A column-major product is the row-major product of the transposes,
+    // C^T = op(B)^T op(A)^T, so swap the operands and their flags; op(A)
+    // is Arows x Acols and op(B) Brows x Bcols either way.
+    int ta = transA, tb = transB;
+    if (colmajor)
     {
-        perror("Couldn't obtain device information");
-        exit(1);
+        void* t = A; A = B; B = t;
+        ta = transB; tb = transA;
+        int n = Arows; Arows = Bcols; Bcols = n;
     }
 
-    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,sizeof(local_size),
+            &local_size, NULL);
+    if (verbose) printf("Max work group size: %d\n", (int) local_size);
 
     if (err < 0)
     {
-        perror("Couldn't create context.\n");
+        perror("Couldn't obtain device information");
         exit(1);
     }
 
-    int* Arows = (int *) malloc(sizeof(int));
-    int* Acols = (int *) malloc(sizeof(int));
-    int* Brows = (int *) malloc(sizeof(int));
-    int* Bcols = (int *) malloc(sizeof(int));
-
-    float* A = readDataFile("A.txt", Arows, Acols);  // Input array
-    float* B = readDataFile("B.txt", Brows, Bcols);  // Input array
-
-    clock_t start;
-
-    int Adatasize = sizeof(float)*(*Arows)*(*Acols);
-    int Bdatasize = sizeof(float)*(*Brows)*(*Bcols);
-    int Cdatasize = sizeof(float)*(*Arows)*(*Bcols);
-
-    float* C = (float*) malloc(Cdatasize);  // Output array
-
-    cmdQueue = clCreateCommandQueue(context, device, 
-            CL_QUEUE_PROFILING_ENABLE,&status);
-    chk(status, "create cmd queue");
-
-
     // define an index space (global work size) of work 
     // items for execution. a workgroup size (local work size) 
     // is not required, but can be used.
@@ -374,371 +342,1629 @@ int main_fp()
     size_t globalworksize[2] ;   
     size_t localWorkSize[2];
 
-    // Choose local size appropriately. 
-    int ls;
-    ls = sqrt(local_size);
+    // Choose local size appropriately. The tiled kernel also takes an
+    // ls wide by lsy high group, stepping through K min(ls, lsy) at a time.
+    int ls, lsy;
+    ls = (cfg->ls > 0 ? cfg->ls : sqrt(local_size));
+    lsy = (cfg->lsy > 0 ? cfg->lsy : ls);
+    int tile_k = (ls < lsy ? ls : lsy);
 
     localWorkSize[0] = ls;
-    localWorkSize[1] = ls;
-
-    globalworksize[0] = (*Bcols % ls == 0 ? *Bcols : (*Bcols/ls + 1)*ls);
-    globalworksize[1] = (*Arows % ls == 0 ? *Arows : (*Arows/ls + 1)*ls);
-
-    int Apad_rows = globalworksize[1] - *Arows;
-    int Apad_cols = (*Acols % ls == 0 ? *Acols : (*Acols/ls + 1) * ls) - *Acols;
-
-    int Bpad_rows = Apad_cols;
-    int Bpad_cols = globalworksize[0] - *Bcols;
-
-    Bdatasize = sizeof(float)*((*Brows + Bpad_rows)*(*Bcols + Bpad_cols));
-    Adatasize = sizeof(float)*((*Arows + Apad_rows)*(*Acols + Apad_cols));
-    Cdatasize = sizeof(float)*(globalworksize[0]*globalworksize[1]);
-
-    C = (float*) realloc(C, Cdatasize);
-    status = (C == NULL);
-
-    chk(status, "Reallocation.");
-
- 
-    for (i = 0; i < Cdatasize/sizeof(float); i++)
+    localWorkSize[1] = lsy;
+
+    globalworksize[0] = (Bcols % ls == 0 ? Bcols : (Bcols/ls + 1)*ls);
+    globalworksize[1] = (Arows % lsy == 0 ? Arows : (Arows/lsy + 1)*lsy);
+
+    // Buffers hold exactly the matrices; only the NDRange is rounded up to
+    // the tile, and the kernels bounds check their loads and stores. The
+    // rows keep their natural pitch, so one contiguous write per operand
+    // suffices (and zero-copy devices can wrap the host arrays directly).
+    size_t Adatasize = prec->elsize*(size_t) Arows*Acols;
+    size_t Bdatasize = prec->elsize*(size_t) Brows*Bcols;
+    size_t Cdatasize = prec->elsize*(size_t) Arows*Bcols;
+    if (verbose)
     {
-        C[i] = 0.0;
+        size_t Kpad = (Acols % tile_k == 0 ? Acols : (Acols/tile_k + 1)*tile_k);
+        size_t padded = prec->elsize*(globalworksize[1]*Kpad +
+                Kpad*globalworksize[0] + globalworksize[0]*globalworksize[1]);
+        size_t exact = Adatasize + Bdatasize + Cdatasize;
+        printf("Device footprint: %.2f MB (%.2f MB if padded to %d, %.1f%% saved)\n",
+            exact/1e6, padded/1e6, tile_k, 100.0*(padded - exact)/padded);
     }
 
-    printf("Local work block size is: %d\n", ls);
-    printf("Global work size is: %d by %d\n", (int) globalworksize[0], (int)  globalworksize[1]);
+    // The register blocked kernel covers a TILE x TILE block of C with an
+    // rts x rts work-group, each item computing wpt x wpt outputs.
+    int regblock = (strcmp(cfg->variant, "regblock") == 0);
+    int wpt = cfg->wpt;
+    char options[256];
+    const char* kernel_name = "matmult";
+    strcpy(options, prec->options);
+    epilogueOptions(options);
+    if (ta) strcat(options, " -DTRANS_A");
+    if (tb) strcat(options, " -DTRANS_B");
+    if (regblock)
+    {
+        cl_ulong local_mem;
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem),
+                &local_mem, NULL);
+        int rts = (ls > 16 ? 16 : ls);
+        while (cfg->ls == 0 && rts > 1 && 2*16*rts*wpt*prec->elsize > local_mem)
+        {
+            rts /= 2;
+        }
+        int tile = rts*wpt;
+        sprintf(options + strlen(options),
+                " -DTILE_M=%d -DTILE_N=%d -DTILE_K=16 -DWPT_M=%d -DWPT_N=%d",
+                tile, tile, wpt, wpt);
+        kernel_name = "matmult_regblock";
+        ls = rts;
+        lsy = rts;
+        localWorkSize[0] = rts;
+        localWorkSize[1] = rts;
+        globalworksize[0] = ((Bcols + tile - 1)/tile)*rts;
+        globalworksize[1] = ((Arows + tile - 1)/tile)*rts;
+    }
 
-    int lendefstr = 13;
-    char defstr[lendefstr];
-    sprintf(defstr, "             ");
+    if (verbose)
+    {
+        if (lsy != ls)
+        {
+            printf("Local work block size is: %d x %d\n", ls, lsy);
+        }
+        else
+        {
+            printf("Local work block size is: %d\n", ls);
+        }
+        printf("Global work size is: %d by %d\n", (int) globalworksize[0], (int)  globalworksize[1]);
+    }
 
-    program = build_program(context, device, PROGRAM_FILE, defstr,  lendefstr);
+    program = build_program(rt, PROGRAM_FILE, options);
 
     // Create a buffer object that will contain the data 
     // from the host array A
 
     start = clock();
+    // On unified memory devices these wrap (or are mapped from) host memory
+    // instead of being copied.
     cl_mem bufA;
-    bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, Adatasize, NULL, &status);
-    chk(status, "clCreateBuffer");
+    bufA = oclBuffer(rt, CL_MEM_READ_ONLY, Adatasize, A,
+        Adatasize);
 
     // Create a buffer object that will contain the data 
     // from the host array B
     cl_mem bufB;
-    bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, Bdatasize, NULL, &status);
-    chk(status, "clCreateBuffer");
+    bufB = oclBuffer(rt, CL_MEM_READ_ONLY, Bdatasize, B,
+        Bdatasize);
 
     // Create a buffer object that will hold the output data
     cl_mem bufC;
-    bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, Cdatasize,
-        NULL, &status); 
-    chk(status, "clCreateBuffer");
+    // (read and uploaded as well when the epilogue adds beta*C, the same
+    // condition that builds the kernel with -DBETA)
+    bufC = oclBuffer(rt, epilogue.beta != 0.0 ? CL_MEM_READ_WRITE :
+        CL_MEM_WRITE_ONLY, Cdatasize, C, Cdatasize);
 
-    // Write input array A to the device buffer bufferA
-    status = clEnqueueWriteBuffer(cmdQueue, bufA, CL_FALSE, 
-        0, sizeof(float)*(*Acols)*(*Arows), A, 0, NULL, NULL);
-    chk(status, "clEnqueueWriteBuffer");    
-
-    // Write input array B to the device buffer bufferB
-    status = clEnqueueWriteBuffer(cmdQueue, bufB, CL_FALSE, 
-        0, sizeof(float)*(*Bcols)*(*Brows), B, 0, NULL, NULL);
-    chk(status, "clCreateBuffer");
-
-    kernel[0] = clCreateKernel(program, "matmult", &status);
-    chk(status, "clCreateKernel");
+    kernel[0] = oclGetKernel(rt, program, kernel_name);
 
     // associate the input and output buffers with the kernel 
     status  = clSetKernelArg(kernel[0], 0, sizeof(cl_mem), &bufC);
     status |= clSetKernelArg(kernel[0], 1, sizeof(cl_mem), &bufA);
     status |= clSetKernelArg(kernel[0], 2, sizeof(cl_mem), &bufB);
-    status |= clSetKernelArg(kernel[0], 3, sizeof(int), Arows);
-    status |= clSetKernelArg(kernel[0], 4, sizeof(int), Brows);
-    status |= clSetKernelArg(kernel[0], 5, sizeof(int), Acols);
-    status |= clSetKernelArg(kernel[0], 6, sizeof(int), Bcols);
-    status |= clSetKernelArg(kernel[0], 7, ls*ls*sizeof(float), NULL);
-    status |= clSetKernelArg(kernel[0], 8, ls*ls*sizeof(float), NULL);
+    status |= clSetKernelArg(kernel[0], 3, sizeof(int), &Arows);
+    status |= clSetKernelArg(kernel[0], 4, sizeof(int), &Brows);
+    status |= clSetKernelArg(kernel[0], 5, sizeof(int), &Acols);
+    status |= clSetKernelArg(kernel[0], 6, sizeof(int), &Bcols);
+    if (!regblock)
+    {
+        status |= clSetKernelArg(kernel[0], 7, lsy*tile_k*prec->elsize, NULL);
+        status |= clSetKernelArg(kernel[0], 8, tile_k*ls*prec->elsize, NULL);
+    }
+    // epilogue scalars follow, in the kernel's REAL type, for each part
+    // epilogueOptions built in
+    int arg = (regblock ? 7 : 9);
+    double scalars[3] = {epilogue.alpha, epilogue.beta, epilogue.bias};
+    int used[3] = {epilogue.alpha != 1.0, epilogue.beta != 0.0,
+        epilogue.has_bias};
+    char value[sizeof(double)];
+    for (i = 0; i < 3; i++)
+    {
+        if (used[i])
+        {
+            setReal(value, 0, scalars[i]);
+            status |= clSetKernelArg(kernel[0], arg++, prec->elsize, value);
+        }
+    }
 
     chk(status, "clSetKernelArg");
 
+    // The tuner may ask for shapes a particular kernel cannot run
+    size_t kernel_wg;
+    clGetKernelWorkGroupInfo(kernel[0], device, CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(kernel_wg), &kernel_wg, NULL);
+    if (localWorkSize[0]*localWorkSize[1] > kernel_wg)
+    {
+        printf("Work-group %d x %d exceeds kernel limit %d\n",
+                (int) localWorkSize[0], (int) localWorkSize[1], (int) kernel_wg);
+        clReleaseMemObject(bufA);
+        clReleaseMemObject(bufB);
+        clReleaseMemObject(bufC);
+        return(-1.0);
+    }
+
     // enqueue the kernel for execution
 
     status = clEnqueueNDRangeKernel(cmdQueue, kernel[0], 2, NULL, 
-        globalworksize, localWorkSize, 0, NULL, NULL);
+        globalworksize, localWorkSize, 0, NULL, &prof_event);
     chk(status, "clenqueuendrangekernel");
 
     clFinish(cmdQueue);
-    stoptime(start,"OCL: Move data to device and multiply matrices.");
+    if (verbose) stoptime(start,"OCL: Move data to device and multiply matrices.");
 
     // read the device output buffer to the host output array
-    clEnqueueReadBuffer(cmdQueue, bufC, 1, 0, 
-        Cdatasize, C, 0, NULL, NULL);
-    chk(status, "clenqueuereadbuffer");
-    //clFinish(cmdQueue);
+    oclReadBuffer(rt, bufC, Cdatasize, C);
 
-    float* C_cpu = (float*) malloc(Cdatasize);
-    start = clock();
-    simpleMultiplyCPU(C_cpu, *Acols, *Arows, *Bcols,*Brows, A, B);
-    stoptime(start, "CPU: Multiply Matrices");
+    clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_START,
+            sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_END,
+            sizeof(time_end), &time_end, NULL);
+    clReleaseEvent(prof_event);
 
-    int result = 1;
-    int idx;
-    double diff;
+    // Only the buffers are per call; the program, kernel and queue stay
+    // cached in the runtime.
+    clReleaseMemObject(bufA);
+    clReleaseMemObject(bufB);
+    clReleaseMemObject(bufC);
+    return((time_end - time_start)*1e-9);
+}
 
-    for (idx = 0; idx < (*Arows)*(*Bcols); idx ++)
+// Multiply a sparse A (CSR or ELL, see sparse.h) by the dense B (A->cols x
+// Bcols) into C, with the SpMV kernels when B is a single column. Returns
+// the kernel time in seconds.
+double multiply_sparse(OclRuntime* rt, void* C, const SparseMatrix* A,
+        void* B, int Bcols)
+{
+    cl_int status;
+    cl_event prof_event;
+    cl_ulong time_start, time_end;
+    int ell = (A->format == SPARSE_ELL);
+    int slots = (ell ? A->width*A->rows : A->nnz);
+    size_t Bdatasize = prec->elsize*(size_t) A->cols*Bcols;
+    size_t Cdatasize = prec->elsize*(size_t) A->rows*Bcols;
+    char kernel_name[16];
+    sprintf(kernel_name, "%s_%s", Bcols == 1 ? "spmv" : "spmm",
+            ell ? "ell" : "csr");
+    if (A->nnz == 0)
     {
-        diff = C[idx] - C_cpu[idx];
-        if (diff < 0) diff *= -1;
-        if (diff > 0.01)
-        {
-            result = 0;
-            printf("Breaking, index = %d\n", idx);
-            printf("Total Data size is = %d\n", (*Arows)*(*Bcols));
-            printf("OCL: %f\n", C[idx]);
-            printf("CPU: %f\n", C_cpu[idx]);
+        memset(C, 0, Cdatasize);
+        return(0.0);
+    }
 
-            //break;
-        }
+    cl_program program = build_program(rt, SPARSE_PROGRAM_FILE, prec->options);
+    cl_kernel kernel = oclGetKernel(rt, program, kernel_name);
+
+    cl_mem bufRowPtr = NULL;
+    if (!ell)
+    {
+        bufRowPtr = oclBuffer(rt, CL_MEM_READ_ONLY, sizeof(int)*(A->rows + 1),
+                A->row_ptr, sizeof(int)*(A->rows + 1));
     }
-    if(result) {
-        printf("Output is correct\n");
-    } else {
-        printf("Output is incorrect\n");
+    cl_mem bufCol = oclBuffer(rt, CL_MEM_READ_ONLY, sizeof(int)*slots,
+            A->col_idx, sizeof(int)*slots);
+    cl_mem bufVal = oclBuffer(rt, CL_MEM_READ_ONLY, prec->elsize*slots,
+            A->values, prec->elsize*slots);
+    cl_mem bufB = oclBuffer(rt, CL_MEM_READ_ONLY, Bdatasize, B, Bdatasize);
+    cl_mem bufC = oclBuffer(rt, CL_MEM_WRITE_ONLY, Cdatasize, C, Cdatasize);
+
+    int arg = 0;
+    status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &bufC);
+    if (!ell)
+    {
+        status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &bufRowPtr);
+    }
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &bufCol);
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &bufVal);
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &bufB);
+    status |= clSetKernelArg(kernel, arg++, sizeof(int), &A->rows);
+    if (ell)
+    {
+        status |= clSetKernelArg(kernel, arg++, sizeof(int), &A->width);
+    }
+    if (Bcols > 1)
+    {
+        status |= clSetKernelArg(kernel, arg++, sizeof(int), &Bcols);
     }
+    chk(status, "clSetKernelArg");
 
-    // Free OpenCL resources
-    clReleaseKernel(kernel[0]);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(cmdQueue);
-    clReleaseMemObject(bufA);
-    clReleaseMemObject(bufB);
-    clReleaseMemObject(bufC);
+    // One item per row for SpMV, per element of C for SpMM; the sizes are
+    // rounded up and the kernels drop the overhang.
+    size_t localWorkSize[2] = {16, 16};
+    size_t globalworksize[2];
+    cl_uint dims = 2;
+    if (Bcols == 1)
+    {
+        dims = 1;
+        localWorkSize[0] = 64;
+        globalworksize[0] = ((A->rows + 63)/64)*64;
+    }
+    else
+    {
+        globalworksize[0] = ((Bcols + 15)/16)*16;
+        globalworksize[1] = ((A->rows + 15)/16)*16;
+    }
+    status = clEnqueueNDRangeKernel(rt->queue, kernel, dims, NULL,
+            globalworksize, localWorkSize, 0, NULL, &prof_event);
+    chk(status, "clEnqueueNDRangeKernel");
+    clFinish(rt->queue);
 
-    clReleaseContext(context);
+    oclReadBuffer(rt, bufC, Cdatasize, C);
 
-    // Free host resources
-    free(A);
-    free(B);
-    free(C);
+    clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_START,
+            sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_END,
+            sizeof(time_end), &time_end, NULL);
+    clReleaseEvent(prof_event);
 
-    return 0;
+    if (bufRowPtr != NULL)
+    {
+        clReleaseMemObject(bufRowPtr);
+    }
+    clReleaseMemObject(bufCol);
+    clReleaseMemObject(bufVal);
+    clReleaseMemObject(bufB);
+    clReleaseMemObject(bufC);
+    return((time_end - time_start)*1e-9);
 }
 
-int main_fp64()
+// The one-element-per-item tiled kernel in the current precision.
+cl_kernel tiled_kernel(OclRuntime* rt)
 {
+    cl_program program = build_program(rt, PROGRAM_FILE, prec->options);
+    return(oclGetKernel(rt, program, "matmult"));
+}
 
-    int i;
-    cl_int status;  
-     
-    cl_device_id device;
-    cl_context context;
-    cl_program program;
-    cl_kernel kernel[NUM_KERNELS];
-    cl_command_queue cmdQueue;
+// Out-of-core multiply with the tiled kernel. C is produced in P x P
+// blocks: a K x P column panel of B stays resident while the P x K row
+// panels of A stream past it. As many A panels as the budget allows are
+// kept on the device, so when all of them fit A is uploaded only once.
+double multiply_ooc(OclRuntime* rt, const MatmultConfig* cfg, size_t elsize,
+        void* C, void* A, void* B, int Arows, int Acols, int Bcols,
+        size_t budget_bytes)
+{
+    cl_int status;
+    cl_kernel kernel = tiled_kernel(rt);
     cl_event prof_event;
-    cl_int j, err, num_groups;
-    size_t local_size, global_size;
-
-    char kernel_names[NUM_KERNELS][20] = {"matmult_fp64"};
-    int BLOCKSIZE; 
-    device = create_device();
-    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,sizeof(local_size),
-            &local_size, NULL);
-    printf("Max work group size: %d\n", (int) local_size);
-    if (err < 0)
+    cl_ulong time_start, time_end;
+    size_t local_size;
+    double kernel_time = 0.0;
+    int K = Acols;
+    int i, j, slot;
+
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+            sizeof(local_size), &local_size, NULL);
+    int tiled = (cfg->ls > 0 && strcmp(cfg->variant, "tiled") == 0);
+    int ls = (tiled ? cfg->ls : (int) sqrt(local_size));
+    int lsy = (tiled && cfg->lsy > 0 ? cfg->lsy : ls);
+    int tile_k = (ls < lsy ? ls : lsy);
+
+    // Largest panel width (a multiple of the longer side of the work-group)
+    // whose B panel, A panel and C block fit the budget together.
+    int step = (ls > lsy ? ls : lsy);
+    size_t budget_elems = budget_bytes/elsize;
+    int maxdim = (Arows > Bcols ? Arows : Bcols);
+    int P = ((maxdim + step - 1)/step)*step;
+    while (P >= step && 2*(size_t) P*K + (size_t) P*P > budget_elems)
     {
-        perror("Couldn't obtain device information");
-        exit(1);
+        P -= step;
     }
-
-    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-
-    if (err < 0)
+    if (P < step)
     {
-        perror("Couldn't create context.\n");
+        printf("Budget of %lu bytes is too small for a %d x %d panel\n",
+                (unsigned long) budget_bytes, step, K);
         exit(1);
     }
+    int nI = (Arows + P - 1)/P;
+    int nJ = (Bcols + P - 1)/P;
+    int slots = (budget_elems - (size_t) K*P - (size_t) P*P)/((size_t) P*K);
+    if (slots > nI) slots = nI;
+    if (slots < 1) slots = 1;
+    printf("Out-of-core: %d x %d panels of width %d, %d resident A panels\n",
+            nI, nJ, P, slots);
+
+    cl_mem bufB = clCreateBuffer(rt->context, CL_MEM_READ_ONLY,
+            elsize*K*P, NULL, &status);
+    chk(status, "clCreateBuffer");
+    cl_mem bufC = clCreateBuffer(rt->context, CL_MEM_WRITE_ONLY,
+            elsize*P*P, NULL, &status);
+    chk(status, "clCreateBuffer");
+    cl_mem* bufA = (cl_mem*) malloc(slots*sizeof(cl_mem));
+    int* resident = (int*) malloc(slots*sizeof(int));
+    for (slot = 0; slot < slots; slot++)
+    {
+        bufA[slot] = clCreateBuffer(rt->context, CL_MEM_READ_ONLY,
+                elsize*P*K, NULL, &status);
+        chk(status, "clCreateBuffer");
+        resident[slot] = -1;
+    }
 
-    int* Arows = (int *) malloc(sizeof(int));
-    int* Acols = (int *) malloc(sizeof(int));
-    int* Brows = (int *) malloc(sizeof(int));
-    int* Bcols = (int *) malloc(sizeof(int));
-
-    double* A = readDataFileDouble("A.txt", Arows, Acols);  // Input array
-    double* B = readDataFileDouble("B.txt", Brows, Bcols);  // Input array
+    int uploads = 0;
+    for (j = 0; j < nJ; j++)
+    {
+        int cb = (Bcols - j*P < P ? Bcols - j*P : P);
+        size_t buffer_origin[3] = {0, 0, 0};
+        size_t host_origin[3] = {j*P*elsize, 0, 0};
+        size_t region[3] = {cb*elsize, K, 1};
+        status = clEnqueueWriteBufferRect(rt->queue, bufB, CL_FALSE,
+                buffer_origin, host_origin, region, cb*elsize, 0,
+                Bcols*elsize, 0, B, 0, NULL, NULL);
+        chk(status, "clEnqueueWriteBufferRect");
+
+        for (i = 0; i < nI; i++)
+        {
+            int rb = (Arows - i*P < P ? Arows - i*P : P);
+            slot = i % slots;
+            if (resident[slot] != i)
+            {
+                status = clEnqueueWriteBuffer(rt->queue, bufA[slot], CL_FALSE,
+                        0, elsize*rb*K, (char*) A + elsize*i*P*K, 0, NULL,
+                        NULL);
+                chk(status, "clEnqueueWriteBuffer");
+                resident[slot] = i;
+                uploads++;
+            }
 
-    clock_t start;
+            status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufC);
+            status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &bufA[slot]);
+            status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufB);
+            status |= clSetKernelArg(kernel, 3, sizeof(int), &rb);
+            status |= clSetKernelArg(kernel, 4, sizeof(int), &K);
+            status |= clSetKernelArg(kernel, 5, sizeof(int), &K);
+            status |= clSetKernelArg(kernel, 6, sizeof(int), &cb);
+            status |= clSetKernelArg(kernel, 7, lsy*tile_k*elsize, NULL);
+            status |= clSetKernelArg(kernel, 8, tile_k*ls*elsize, NULL);
+            chk(status, "clSetKernelArg");
+
+            size_t localWorkSize[2] = {ls, lsy};
+            size_t globalworksize[2] = {((cb + ls - 1)/ls)*ls,
+                ((rb + lsy - 1)/lsy)*lsy};
+            status = clEnqueueNDRangeKernel(rt->queue, kernel, 2, NULL,
+                    globalworksize, localWorkSize, 0, NULL, &prof_event);
+            chk(status, "clenqueuendrangekernel");
+
+            size_t c_origin[3] = {j*P*elsize, i*P, 0};
+            size_t c_region[3] = {cb*elsize, rb, 1};
+            status = clEnqueueReadBufferRect(rt->queue, bufC, CL_FALSE,
+                    buffer_origin, c_origin, c_region, cb*elsize, 0,
+                    Bcols*elsize, 0, C, 0, NULL, NULL);
+            chk(status, "clEnqueueReadBufferRect");
+
+            clWaitForEvents(1, &prof_event);
+            clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_START,
+                    sizeof(time_start), &time_start, NULL);
+            clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_END,
+                    sizeof(time_end), &time_end, NULL);
+            clReleaseEvent(prof_event);
+            kernel_time += (time_end - time_start)*1e-9;
+        }
+    }
+    clFinish(rt->queue);
+    printf("Out-of-core: %d A panel uploads for %d blocks\n", uploads, nI*nJ);
 
-    int Adatasize = sizeof(double)*(*Arows)*(*Acols);
-    int Bdatasize = sizeof(double)*(*Brows)*(*Bcols);
-    int Cdatasize = sizeof(double)*(*Arows)*(*Bcols);
+    for (slot = 0; slot < slots; slot++)
+    {
+        clReleaseMemObject(bufA[slot]);
+    }
+    clReleaseMemObject(bufB);
+    clReleaseMemObject(bufC);
+    free(bufA);
+    free(resident);
+    return(kernel_time);
+}
 
-    double* C = (double*) malloc(Cdatasize);  // Output array
+// Pipelined multiply: A and C are split into npanels row panels that cycle
+// through two device buffers. Uploads, kernels and readbacks go to three
+// queues chained by events, so panel k+1 is written while panel k is
+// multiplied and panel k-1 is read back.
+double multiply_pipelined(OclRuntime* rt, const MatmultConfig* cfg,
+        size_t elsize, void* C, void* A, void* B, int Arows, int Acols,
+        int Bcols, int npanels)
+{
+    cl_int status;
+    cl_kernel kernel = tiled_kernel(rt);
+    cl_command_queue write_queue = oclQueue(rt, 1);
+    cl_command_queue kernel_queue = oclQueue(rt, 0);
+    cl_command_queue read_queue = oclQueue(rt, 2);
+    cl_ulong time_start, time_end;
+    size_t local_size;
+    double kernel_time = 0.0;
+    int K = Acols;
+    int k, slot;
+
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+            sizeof(local_size), &local_size, NULL);
+    int tiled = (cfg->ls > 0 && strcmp(cfg->variant, "tiled") == 0);
+    int ls = (tiled ? cfg->ls : (int) sqrt(local_size));
+    int lsy = (tiled && cfg->lsy > 0 ? cfg->lsy : ls);
+    int tile_k = (ls < lsy ? ls : lsy);
+    int R = (Arows + npanels - 1)/npanels;
+    R = ((R + lsy - 1)/lsy)*lsy;
+    int np = (Arows + R - 1)/R;
+    printf("Pipeline: %d row panels of %d rows\n", np, R);
+
+    cl_mem bufB = clCreateBuffer(rt->context, CL_MEM_READ_ONLY,
+            elsize*K*Bcols, NULL, &status);
+    chk(status, "clCreateBuffer");
+    cl_mem bufA[2], bufC[2];
+    for (slot = 0; slot < 2; slot++)
+    {
+        bufA[slot] = clCreateBuffer(rt->context, CL_MEM_READ_ONLY,
+                elsize*R*K, NULL, &status);
+        chk(status, "clCreateBuffer");
+        bufC[slot] = clCreateBuffer(rt->context, CL_MEM_WRITE_ONLY,
+                elsize*R*Bcols, NULL, &status);
+        chk(status, "clCreateBuffer");
+    }
 
-    cmdQueue = clCreateCommandQueue(context, device, 
-            CL_QUEUE_PROFILING_ENABLE,&status);
-    chk(status, "create cmd queue");
+    // events[0] is the B upload, then write/kernel/read for each panel
+    int nevents = 1 + 3*np;
+    cl_event* events = (cl_event*) malloc(nevents*sizeof(cl_event));
+    int* kinds = (int*) malloc(nevents*sizeof(int));
+    cl_event* up = events + 1;
+    cl_event* ker = events + 1 + np;
+    cl_event* down = events + 1 + 2*np;
 
+    status = clEnqueueWriteBuffer(write_queue, bufB, CL_FALSE, 0,
+            elsize*K*Bcols, B, 0, NULL, &events[0]);
+    chk(status, "clEnqueueWriteBuffer");
+    kinds[0] = OCL_EVENT_WRITE;
 
-    // define an index space (global work size) of work 
-    // items for execution. a workgroup size (local work size) 
-    // is not required, but can be used.
+    for (k = 0; k < np; k++)
+    {
+        int rb = (Arows - k*R < R ? Arows - k*R : R);
+        cl_event wait[3];
+        int nwait;
+        slot = k % 2;
+
+        // The A slot is free once the kernel two panels back has run
+        status = clEnqueueWriteBuffer(write_queue, bufA[slot], CL_FALSE, 0,
+                elsize*rb*K, (char*) A + elsize*k*R*K, (k >= 2 ? 1 : 0),
+                (k >= 2 ? &ker[k - 2] : NULL), &up[k]);
+        chk(status, "clEnqueueWriteBuffer");
+        kinds[1 + k] = OCL_EVENT_WRITE;
+
+        // and the C slot once that panel has been read back
+        nwait = 0;
+        wait[nwait++] = events[0];
+        wait[nwait++] = up[k];
+        if (k >= 2) wait[nwait++] = down[k - 2];
+
+        status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufC[slot]);
+        status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &bufA[slot]);
+        status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufB);
+        status |= clSetKernelArg(kernel, 3, sizeof(int), &rb);
+        status |= clSetKernelArg(kernel, 4, sizeof(int), &K);
+        status |= clSetKernelArg(kernel, 5, sizeof(int), &K);
+        status |= clSetKernelArg(kernel, 6, sizeof(int), &Bcols);
+        status |= clSetKernelArg(kernel, 7, lsy*tile_k*elsize, NULL);
+        status |= clSetKernelArg(kernel, 8, tile_k*ls*elsize, NULL);
+        chk(status, "clSetKernelArg");
+
+        size_t localWorkSize[2] = {ls, lsy};
+        size_t globalworksize[2] = {((Bcols + ls - 1)/ls)*ls,
+            ((rb + lsy - 1)/lsy)*lsy};
+        status = clEnqueueNDRangeKernel(kernel_queue, kernel, 2, NULL,
+                globalworksize, localWorkSize, nwait, wait, &ker[k]);
+        chk(status, "clenqueuendrangekernel");
+        kinds[1 + np + k] = OCL_EVENT_KERNEL;
+
+        status = clEnqueueReadBuffer(read_queue, bufC[slot], CL_FALSE, 0,
+                elsize*rb*Bcols, (char*) C + elsize*k*R*Bcols, 1, &ker[k],
+                &down[k]);
+        chk(status, "clEnqueueReadBuffer");
+        kinds[1 + 2*np + k] = OCL_EVENT_READ;
+
+        clFlush(write_queue);
+        clFlush(kernel_queue);
+        clFlush(read_queue);
+    }
+    clFinish(write_queue);
+    clFinish(kernel_queue);
+    clFinish(read_queue);
 
-    size_t globalworksize[2] ;   
-    size_t localWorkSize[2];
+    oclReportTimeline(events, kinds, nevents);
+    for (k = 0; k < np; k++)
+    {
+        clGetEventProfilingInfo(ker[k], CL_PROFILING_COMMAND_START,
+                sizeof(time_start), &time_start, NULL);
+        clGetEventProfilingInfo(ker[k], CL_PROFILING_COMMAND_END,
+                sizeof(time_end), &time_end, NULL);
+        kernel_time += (time_end - time_start)*1e-9;
+    }
+    for (k = 0; k < nevents; k++)
+    {
+        clReleaseEvent(events[k]);
+    }
+    for (slot = 0; slot < 2; slot++)
+    {
+        clReleaseMemObject(bufA[slot]);
+        clReleaseMemObject(bufC[slot]);
+    }
+    clReleaseMemObject(bufB);
+    free(events);
+    free(kinds);
+    return(kernel_time);
+}
 
-    // Choose local size appropriately. 
-    int ls;
-    ls = sqrt(local_size);
-    //ls = 1;
-    localWorkSize[0] = ls;
-    localWorkSize[1] = ls;
+// Multiply count independent M x K by K x N products in one launch. Matrix
+// b of A, B and C starts b*strideA, b*strideB and b*strideC elements in
+// (packed arrays use the matrix sizes; strideB 0 shares one B). Returns
+// the kernel time in seconds.
+double multiply_batched(OclRuntime* rt, void* C, void* A, void* B, int count,
+        int M, int K, int N, int strideA, int strideB, int strideC)
+{
+    cl_int status;
+    cl_event prof_event;
+    cl_ulong time_start, time_end, local_mem;
+    size_t max_wg, max_items[3] = {1, 1, 1};
+    size_t elsize = prec->elsize;
+
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+            sizeof(max_wg), &max_wg, NULL);
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+            sizeof(max_items), max_items, NULL);
+    clGetDeviceInfo(rt->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem),
+            &local_mem, NULL);
+
+    // Up to 16 x 16 items per product, and several products per group when
+    // they are tiny, as long as each item has at most 16 outputs.
+    int lx = (N < 16 ? N : 16);
+    int ly = (M < 16 ? M : 16);
+    while ((size_t) lx*ly > max_wg)
+    {
+        if (lx >= ly) lx = (lx + 1)/2;
+        else ly = (ly + 1)/2;
+    }
+    if (((M + ly - 1)/ly)*((N + lx - 1)/lx) > 16)
+    {
+        printf("Batched products of %d x %d are too large for this device\n",
+                M, N);
+        exit(1);
+    }
+    int lz = 64/(lx*ly);
+    if (lz < 1) lz = 1;
+    while (lz > 1 && ((size_t) lx*ly*lz > max_wg || (size_t) lz > max_items[2]))
+    {
+        lz /= 2;
+    }
+    // Columns of A (rows of B) staged per step; the whole K when it fits.
+    int KC = K;
+    while (KC > 1 && lz*((size_t) M + N)*KC*elsize > local_mem)
+    {
+        KC = (KC + 1)/2;
+    }
+    while (lz > 1 && lz*((size_t) M + N)*KC*elsize > local_mem)
+    {
+        lz /= 2;
+    }
+    if (verbose)
+    {
+        printf("Batch: %d products of %d x %d x %d, work-group %d x %d x %d, "
+                "K chunk %d\n", count, M, K, N, lx, ly, lz, KC);
+    }
 
-    globalworksize[0] = (*Bcols % ls == 0 ? *Bcols : (*Bcols/ls + 1)*ls);
-    globalworksize[1] = (*Arows % ls == 0 ? *Arows : (*Arows/ls + 1)*ls);
+    size_t sizeA = elsize*((size_t) (count - 1)*strideA + (size_t) M*K);
+    size_t sizeB = elsize*((size_t) (count - 1)*strideB + (size_t) K*N);
+    size_t sizeC = elsize*((size_t) (count - 1)*strideC + (size_t) M*N);
+    cl_mem bufA = oclBuffer(rt, CL_MEM_READ_ONLY, sizeA, A, sizeA);
+    cl_mem bufB = oclBuffer(rt, CL_MEM_READ_ONLY, sizeB, B, sizeB);
+    cl_mem bufC = oclBuffer(rt, CL_MEM_WRITE_ONLY, sizeC, C, sizeC);
+
+    cl_program program = build_program(rt, PROGRAM_FILE, prec->options);
+    cl_kernel kernel = oclGetKernel(rt, program, "matmult_batched");
+    status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufC);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &bufA);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufB);
+    status |= clSetKernelArg(kernel, 3, sizeof(int), &M);
+    status |= clSetKernelArg(kernel, 4, sizeof(int), &K);
+    status |= clSetKernelArg(kernel, 5, sizeof(int), &N);
+    status |= clSetKernelArg(kernel, 6, sizeof(int), &strideA);
+    status |= clSetKernelArg(kernel, 7, sizeof(int), &strideB);
+    status |= clSetKernelArg(kernel, 8, sizeof(int), &strideC);
+    status |= clSetKernelArg(kernel, 9, sizeof(int), &count);
+    status |= clSetKernelArg(kernel, 10, sizeof(int), &KC);
+    status |= clSetKernelArg(kernel, 11, lz*M*KC*elsize, NULL);
+    status |= clSetKernelArg(kernel, 12, lz*KC*N*elsize, NULL);
+    chk(status, "clSetKernelArg");
 
-    int Apad_rows = globalworksize[1] - *Arows;
-    int Apad_cols = (*Acols % ls == 0 ? *Acols : (*Acols/ls + 1) * ls) - *Acols;
+    size_t localWorkSize[3] = {lx, ly, lz};
+    size_t globalworksize[3] = {lx, ly, ((count + lz - 1)/lz)*lz};
+    status = clEnqueueNDRangeKernel(rt->queue, kernel, 3, NULL,
+            globalworksize, localWorkSize, 0, NULL, &prof_event);
+    chk(status, "clenqueuendrangekernel");
+    oclReadBuffer(rt, bufC, sizeC, C);
 
-    int Bpad_rows = Apad_cols;
-    int Bpad_cols = globalworksize[0] - *Bcols;
+    clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_START,
+            sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(prof_event, CL_PROFILING_COMMAND_END,
+            sizeof(time_end), &time_end, NULL);
+    clReleaseEvent(prof_event);
+    clReleaseMemObject(bufA);
+    clReleaseMemObject(bufB);
+    clReleaseMemObject(bufC);
+    return((time_end - time_start)*1e-9);
+}
 
-    Bdatasize = sizeof(double)*((*Brows + Bpad_rows)*(*Bcols + Bpad_cols));
-    Adatasize = sizeof(double)*((*Arows + Apad_rows)*(*Acols + Apad_cols));
-    Cdatasize = sizeof(double)*(globalworksize[0]*globalworksize[1]);
+// Work queued on one device by the multi-device scheduler.
+typedef struct
+{
+    OclRuntime* rt;
+    int node;  // NUMA node for host buffers, -1 to use the caller's arrays
+    cl_mem bufA, bufB, bufC;
+    cl_event first, last;
+    void* hostA;
+    void* hostB;
+    void* hostC;
+    void* mappedC;
+    void* C;
+    size_t elsize;
+    int row0, rows, K, N;
+} DeviceWork;
+
+OclRuntime* md_runtimes[OCL_MAX_DEVICES];
+int md_count = 0;
+double md_rate[OCL_MAX_DEVICES];  // rows of C per second, 0 until measured
+int md_node[OCL_MAX_DEVICES];  // NUMA node of each -numa sub-device, or -1
+// Shortest time a share is taken to have run for. A probe that finishes
+// inside the timer resolution would otherwise report an infinite rate and
+// leave every other device with no rows.
+#define MD_MIN_SECONDS 1e-6
+
+// Queue rows [row0, row0 + rows) of C on w->rt without waiting for them.
+void md_enqueue(DeviceWork* w, size_t elsize, void* C, void* A, void* B,
+        int row0, int rows, int K, int N)
+{
+    cl_int status;
+    size_t local_size;
+    cl_kernel kernel = tiled_kernel(w->rt);
+    clGetDeviceInfo(w->rt->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+            sizeof(local_size), &local_size, NULL);
+    int ls = sqrt(local_size);
+
+    w->C = C;
+    w->elsize = elsize;
+    w->row0 = row0;
+    w->rows = rows;
+    w->K = K;
+    w->N = N;
+
+    if (w->node >= 0)
+    {
+        // The sub-device works straight out of memory on its own node:
+        // its rows of A, a private copy of B and its rows of C.
+        w->hostA = oclHostAlloc(elsize*rows*K, w->node);
+        w->hostB = oclHostAlloc(elsize*K*N, w->node);
+        w->hostC = oclHostAlloc(elsize*rows*N, w->node);
+        memcpy(w->hostA, (char*) A + elsize*row0*K, elsize*rows*K);
+        memcpy(w->hostB, B, elsize*K*N);
+        w->bufA = clCreateBuffer(w->rt->context,
+                CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, elsize*rows*K,
+                w->hostA, &status);
+        chk(status, "clCreateBuffer");
+        w->bufB = clCreateBuffer(w->rt->context,
+                CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, elsize*K*N,
+                w->hostB, &status);
+        chk(status, "clCreateBuffer");
+        w->bufC = clCreateBuffer(w->rt->context,
+                CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, elsize*rows*N,
+                w->hostC, &status);
+        chk(status, "clCreateBuffer");
+        status = clEnqueueMarker(w->rt->queue, &w->first);
+        chk(status, "clEnqueueMarker");
+    }
+    else
+    {
+        w->bufA = clCreateBuffer(w->rt->context, CL_MEM_READ_ONLY,
+                elsize*rows*K, NULL, &status);
+        chk(status, "clCreateBuffer");
+        w->bufB = clCreateBuffer(w->rt->context, CL_MEM_READ_ONLY,
+                elsize*K*N, NULL, &status);
+        chk(status, "clCreateBuffer");
+        w->bufC = clCreateBuffer(w->rt->context, CL_MEM_WRITE_ONLY,
+                elsize*rows*N, NULL, &status);
+        chk(status, "clCreateBuffer");
+
+        status = clEnqueueWriteBuffer(w->rt->queue, w->bufA, CL_FALSE, 0,
+                elsize*rows*K, (char*) A + elsize*row0*K, 0, NULL, &w->first);
+        chk(status, "clEnqueueWriteBuffer");
+        status = clEnqueueWriteBuffer(w->rt->queue, w->bufB, CL_FALSE, 0,
+                elsize*K*N, B, 0, NULL, NULL);
+        chk(status, "clEnqueueWriteBuffer");
+    }
 
-    C = (double*) realloc(C, Cdatasize);
-    status = (C == NULL);
+    status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &w->bufC);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &w->bufA);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &w->bufB);
+    status |= clSetKernelArg(kernel, 3, sizeof(int), &rows);
+    status |= clSetKernelArg(kernel, 4, sizeof(int), &K);
+    status |= clSetKernelArg(kernel, 5, sizeof(int), &K);
+    status |= clSetKernelArg(kernel, 6, sizeof(int), &N);
+    status |= clSetKernelArg(kernel, 7, ls*ls*elsize, NULL);
+    status |= clSetKernelArg(kernel, 8, ls*ls*elsize, NULL);
+    chk(status, "clSetKernelArg");
 
-    chk(status, "Reallocation.");
+    size_t localWorkSize[2] = {ls, ls};
+    size_t globalworksize[2] = {((N + ls - 1)/ls)*ls, ((rows + ls - 1)/ls)*ls};
+    status = clEnqueueNDRangeKernel(w->rt->queue, kernel, 2, NULL,
+            globalworksize, localWorkSize, 0, NULL, NULL);
+    chk(status, "clenqueuendrangekernel");
 
- 
-    for (i = 0; i < Cdatasize/sizeof(double); i++)
+    if (w->node >= 0)
     {
-        C[i] = 0.0;
+        w->mappedC = clEnqueueMapBuffer(w->rt->queue, w->bufC, CL_FALSE,
+                CL_MAP_READ, 0, elsize*rows*N, 0, NULL, &w->last, &status);
+        chk(status, "clEnqueueMapBuffer");
     }
+    else
+    {
+        status = clEnqueueReadBuffer(w->rt->queue, w->bufC, CL_FALSE, 0,
+                elsize*rows*N, (char*) C + elsize*row0*N, 0, NULL, &w->last);
+        chk(status, "clEnqueueReadBuffer");
+    }
+    clFlush(w->rt->queue);
+}
 
-    printf("Local work block size is: %d\n", ls);
-    printf("Global work size is: %d by %d\n", (int) globalworksize[0], (int) globalworksize[1]);
-
-    int lendefstr = 15;
-    char defstr[lendefstr];
-    sprintf(defstr, "#define FP_64 1"); 
-    printf("%s\n", defstr);
-    
-    program = build_program(context, device, PROGRAM_FILE_fp64, defstr,  lendefstr);
-
-    // Create a buffer object that will contain the data 
-    // from the host array A
+// Wait for the device and return how long its share took, measured on its
+// own clock from the first upload to the last readback.
+double md_finish(DeviceWork* w)
+{
+    cl_ulong time_start, time_end;
+    clFinish(w->rt->queue);
+    clGetEventProfilingInfo(w->first, CL_PROFILING_COMMAND_START,
+            sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(w->last, CL_PROFILING_COMMAND_END,
+            sizeof(time_end), &time_end, NULL);
+    clReleaseEvent(w->first);
+    clReleaseEvent(w->last);
+    if (w->node >= 0)
+    {
+        memcpy((char*) w->C + w->elsize*w->row0*w->N, w->mappedC,
+                w->elsize*w->rows*w->N);
+        clEnqueueUnmapMemObject(w->rt->queue, w->bufC, w->mappedC, 0, NULL,
+                NULL);
+        clFinish(w->rt->queue);
+    }
+    clReleaseMemObject(w->bufA);
+    clReleaseMemObject(w->bufB);
+    clReleaseMemObject(w->bufC);
+    if (w->node >= 0)
+    {
+        oclHostFree(w->hostA, w->elsize*w->rows*w->K);
+        oclHostFree(w->hostB, w->elsize*w->K*w->N);
+        oclHostFree(w->hostC, w->elsize*w->rows*w->N);
+    }
+    return((time_end - time_start)*1e-9);
+}
 
-    start = clock();
-    cl_mem bufA;
-    bufA = clCreateBuffer(context, CL_MEM_READ_ONLY, Adatasize, NULL, &status);
-    chk(status, "clCreateBuffer");
+// Multiply on every device (or every NUMA node of the default device) at
+// once, each taking a block of rows of C in proportion to its measured
+// throughput. Devices are timed with a small probe the first time, and
+// every run refines the estimate.
+double multiply_multidevice(size_t elsize, void* C, void* A, void* B,
+        int Arows, int Acols, int Bcols)
+{
+    DeviceWork work[OCL_MAX_DEVICES];
+    int rows[OCL_MAX_DEVICES];
+    double total_rate = 0.0, slowest = 0.0;
+    int d, assigned = 0, fastest = 0;
 
-    // Create a buffer object that will contain the data 
-    // from the host array B
-    cl_mem bufB;
-    bufB = clCreateBuffer(context, CL_MEM_READ_ONLY, Bdatasize, NULL, &status);
-    chk(status, "clCreateBuffer");
+    if (md_count == 0)
+    {
+        cl_device_id devs[OCL_MAX_DEVICES];
+        if (numa)
+        {
+            md_count = oclNumaDevices(create_device(), devs, OCL_MAX_DEVICES);
+            if (md_count == 0)
+            {
+                printf("Device can't be partitioned by NUMA node\n");
+                exit(1);
+            }
+        }
+        else
+        {
+            md_count = oclListDevices(devs, OCL_MAX_DEVICES, split);
+        }
+        for (d = 0; d < md_count; d++)
+        {
+            md_runtimes[d] = oclRuntimeForDevice(devs[d]);
+            md_rate[d] = 0.0;
+            // The partition order says nothing about which node a
+            // sub-device is on; unplaced ones work from the shared arrays.
+            md_node[d] = (numa ? oclDeviceNode(md_runtimes[d]) : -1);
+            if (md_node[d] >= 0)
+            {
+                printf("Device %d: %s on NUMA node %d\n", d,
+                        md_runtimes[d]->device_name, md_node[d]);
+            }
+            else
+            {
+                printf("Device %d: %s\n", d, md_runtimes[d]->device_name);
+            }
+        }
+    }
 
-    // Create a buffer object that will hold the output data
-    cl_mem bufC;
-    bufC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, Cdatasize,
-        NULL, &status); 
-    chk(status, "clCreateBuffer");
+    for (d = 0; d < md_count; d++)
+    {
+        if (md_rate[d] == 0.0)
+        {
+            int probe = (Arows < 64 ? Arows : 64);
+            work[d].rt = md_runtimes[d];
+            work[d].node = md_node[d];
+            md_enqueue(&work[d], elsize, C, A, B, 0, probe, Acols, Bcols);
+            md_rate[d] = probe/fmax(md_finish(&work[d]), MD_MIN_SECONDS);
+        }
+        total_rate += md_rate[d];
+        if (md_rate[d] > md_rate[fastest]) fastest = d;
+    }
 
-    // Write input array A to the device buffer bufferA
-    status = clEnqueueWriteBuffer(cmdQueue, bufA, CL_FALSE, 
-        0, sizeof(double)*(*Acols)*(*Arows), A, 0, NULL, NULL);
-    chk(status, "clEnqueueWriteBuffer");    
+    for (d = 0; d < md_count; d++)
+    {
+        rows[d] = (int) (Arows*md_rate[d]/total_rate);
+        assigned += rows[d];
+    }
+    rows[fastest] += Arows - assigned;
 
-    // Write input array B to the device buffer bufferB
-    status = clEnqueueWriteBuffer(cmdQueue, bufB, CL_FALSE, 
-        0, sizeof(double)*(*Bcols)*(*Brows), B, 0, NULL, NULL);
-    chk(status, "clCreateBuffer");
+    assigned = 0;
+    for (d = 0; d < md_count; d++)
+    {
+        work[d].rt = md_runtimes[d];
+        work[d].node = md_node[d];
+        if (rows[d] > 0)
+        {
+            md_enqueue(&work[d], elsize, C, A, B, assigned, rows[d], Acols,
+                    Bcols);
+        }
+        assigned += rows[d];
+    }
+    for (d = 0; d < md_count; d++)
+    {
+        if (rows[d] == 0)
+        {
+            continue;
+        }
+        double t = md_finish(&work[d]);
+        md_rate[d] = rows[d]/fmax(t, MD_MIN_SECONDS);
+        if (t > slowest) slowest = t;
+        printf("Device %d: %d rows in %.3lf ms (%.0lf rows/s)\n", d, rows[d],
+                t*1e3, md_rate[d]);
+    }
+    return(slowest);
+}
 
-    kernel[0] = clCreateKernel(program, "matmult_fp64", &status);
-    chk(status, "clCreateKernel");
+// Budget to stream with, or 0 when the whole problem fits in one
+// allocation per matrix.
+size_t ooc_budget(OclRuntime* rt, size_t elsize, int Arows, int Acols,
+        int Bcols)
+{
+    cl_ulong max_alloc, global_mem;
+    if (budget > 0)
+    {
+        return(budget);
+    }
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+            sizeof(max_alloc), &max_alloc, NULL);
+    clGetDeviceInfo(rt->device, CL_DEVICE_GLOBAL_MEM_SIZE,
+            sizeof(global_mem), &global_mem, NULL);
+    size_t a = elsize*Arows*Acols, b = elsize*Acols*Bcols;
+    size_t c = elsize*Arows*Bcols;
+    if (a <= max_alloc && b <= max_alloc && c <= max_alloc &&
+            a + b + c <= global_mem)
+    {
+        return(0);
+    }
+    printf("Matrices exceed device memory, streaming with half of it\n");
+    return(global_mem/2 < max_alloc*3 ? global_mem/2 : max_alloc*3);
+}
 
-    // associate the input and output buffers with the kernel 
-    status  = clSetKernelArg(kernel[0], 0, sizeof(cl_mem), &bufC);
-    status |= clSetKernelArg(kernel[0], 1, sizeof(cl_mem), &bufA);
-    status |= clSetKernelArg(kernel[0], 2, sizeof(cl_mem), &bufB);
-    status |= clSetKernelArg(kernel[0], 3, sizeof(int), Arows);
-    status |= clSetKernelArg(kernel[0], 4, sizeof(int), Brows);
-    status |= clSetKernelArg(kernel[0], 5, sizeof(int), Acols);
-    status |= clSetKernelArg(kernel[0], 6, sizeof(int), Bcols);
-    status |= clSetKernelArg(kernel[0], 7, ls*ls*sizeof(double), NULL);
-    status |= clSetKernelArg(kernel[0], 8, ls*ls*sizeof(double), NULL);
+// Configurations worth timing on this device: every tile width that fits
+// the work-group and local memory limits, for both kernel variants, and
+// for the tiled kernel the groups two or four times wider than high (or
+// the other way round) that fill at least 128 work-items.
+int tuning_candidates(OclRuntime* rt, size_t elsize, MatmultConfig* cands,
+        int max_cands)
+{
+    size_t max_wg;
+    cl_ulong local_mem;
+    int widths[5] = {4, 8, 16, 32, 64};
+    int wpts[2] = {4, 8};
+    int i, j, w, n = 0;
+    clGetDeviceInfo(rt->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wg),
+            &max_wg, NULL);
+    clGetDeviceInfo(rt->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem),
+            &local_mem, NULL);
+    for (i = 0; i < 4 && n < max_cands; i++)
+    {
+        int ls = widths[i];
+        if (ls*ls <= max_wg && 2*ls*ls*elsize <= local_mem)
+        {
+            MatmultConfig c = {"tiled", ls, 0, 0};
+            cands[n++] = c;
+        }
+    }
+    for (i = 0; i < 5; i++)
+    {
+        for (j = 0; j < 5 && n < max_cands; j++)
+        {
+            int lx = widths[i], ly = widths[j];
+            int tile_k = (lx < ly ? lx : ly);
+            int ratio = (lx > ly ? lx/ly : ly/lx);
+            if ((ratio == 2 || ratio == 4) && lx*ly >= 128 &&
+                    (size_t) lx*ly <= max_wg && tile_k*(lx + ly)*elsize <= local_mem)
+            {
+                MatmultConfig c = {"tiled", lx, 0, ly};
+                cands[n++] = c;
+            }
+        }
+    }
+    for (w = 0; w < 2; w++)
+    {
+        for (i = 0; i < 3 && n < max_cands; i++)
+        {
+            int ls = widths[i];
+            if (ls*ls <= max_wg && 2*16*ls*wpts[w]*elsize <= local_mem)
+            {
+                MatmultConfig c = {"regblock", ls, wpts[w], 0};
+                cands[n++] = c;
+            }
+        }
+    }
+    return(n);
+}
 
-    chk(status, "clSetKernelArg");
+// Variant and launch shape of cfg for the tuning messages.
+void describe_config(const MatmultConfig* cfg, char* buf, size_t size)
+{
+    if (cfg->lsy > 0 && cfg->lsy != cfg->ls)
+    {
+        snprintf(buf, size, "%s ls=%dx%d wpt=%d", cfg->variant, cfg->ls,
+                cfg->lsy, cfg->wpt);
+    }
+    else
+    {
+        snprintf(buf, size, "%s ls=%d wpt=%d", cfg->variant, cfg->ls,
+                cfg->wpt);
+    }
+}
 
-    // enqueue the kernel for execution
+// Tuning database key parts for the current flags: the layout as R or C
+// (row or column-major) followed by N or T for A and B, e.g. "RTN", and the
+// epilogue as its parts joined by '+' ("alpha+bias+relu"), or "none".
+void tuning_key(char* layout, char* epi)
+{
+    sprintf(layout, "%c%c%c", colmajor ? 'C' : 'R', transA ? 'T' : 'N',
+            transB ? 'T' : 'N');
+    epi[0] = '\0';
+    if (epilogue.alpha != 1.0)
+    {
+        strcat(epi, "+alpha");
+    }
+    if (epilogue.beta != 0.0)
+    {
+        strcat(epi, "+beta");
+    }
+    if (epilogue.has_bias)
+    {
+        strcat(epi, "+bias");
+    }
+    if (epilogue.activation[0] != '\0')
+    {
+        strcat(epi, "+");
+        strcat(epi, epilogue.activation);
+    }
+    if (epi[0] == '\0')
+    {
+        strcpy(epi, "none");
+    }
+    else
+    {
+        memmove(epi, epi + 1, strlen(epi));
+    }
+}
 
-    status = clEnqueueNDRangeKernel(cmdQueue, kernel[0], 2, NULL, 
-        globalworksize, localWorkSize, 0, NULL, NULL);
-    chk(status, "clenqueuendrangekernel");
+// Time every candidate (best of three kernel runs, from the profiling
+// event) and record the winner for this device, size class, layout and
+// epilogue.
+MatmultConfig tune_config(OclRuntime* rt, void* C, void* A, void* B,
+        int Arows, int Acols, int Brows, int Bcols)
+{
+    MatmultConfig cands[32];
+    MatmultConfig best = config;
+    double best_time = -1.0;
+    char desc[64], layout[4], epi[32];
+    int n = tuning_candidates(rt, prec->elsize, cands, 32);
+    int c, trial;
+    for (c = 0; c < n; c++)
+    {
+        double t = -1.0;
+        for (trial = 0; trial < 3; trial++)
+        {
+            double k = multiply(rt, &cands[c], C, A, B, Arows, Acols,
+                    Brows, Bcols);
+            if (k < 0)
+            {
+                break;
+            }
+            if (t < 0 || k < t)
+            {
+                t = k;
+            }
+        }
+        describe_config(&cands[c], desc, sizeof(desc));
+        if (t < 0)
+        {
+            printf("Tuning: %s not runnable\n", desc);
+            continue;
+        }
+        printf("Tuning: %s kernel %.3lf ms (%.2lf GFLOP/s)\n", desc, t*1e3,
+                2.0*Arows*Acols*Bcols/t*1e-9);
+        if (best_time < 0 || t < best_time)
+        {
+            best_time = t;
+            best = cands[c];
+        }
+    }
+    if (best_time > 0)
+    {
+        describe_config(&best, desc, sizeof(desc));
+        printf("Best: %s (%.3lf ms), saved to %s\n", desc, best_time*1e3,
+                tuningDbFile());
+        tuning_key(layout, epi);
+        tuningStore(rt->device_name, prec->name,
+                tuningSizeClass(Arows, Acols, Bcols), layout, epi, &best,
+                best_time*1e3);
+    }
+    return(best);
+}
 
-    clFinish(cmdQueue);
-    stoptime(start,"OCL: Move data to device and multiply matrices.");
+// The configuration to run with: explicit flags, then a tuning run if
+// requested, then the tuning database, then the untuned default.
+MatmultConfig choose_config(OclRuntime* rt, void* C, void* A, void* B,
+        int Arows, int Acols, int Brows, int Bcols)
+{
+    MatmultConfig cfg = config;
+    char desc[64], layout[4], epi[32];
+    if (tune)
+    {
+        return(tune_config(rt, C, A, B, Arows, Acols, Brows, Bcols));
+    }
+    tuning_key(layout, epi);
+    if (!config_given && tuningLookup(rt->device_name, prec->name,
+                tuningSizeClass(Arows, Acols, Bcols), layout, epi, &cfg))
+    {
+        describe_config(&cfg, desc, sizeof(desc));
+        printf("Using tuned configuration: %s\n", desc);
+    }
+    return(cfg);
+}
 
-    // read the device output buffer to the host output array
-    clEnqueueReadBuffer(cmdQueue, bufC, 1, 0, 
-        Cdatasize, C, 0, NULL, NULL);
-    chk(status, "clenqueuereadbuffer");
-    //clFinish(cmdQueue);
+int run_matmult()
+{
 
-    double* C_cpu = (double*) malloc(Cdatasize);
-    start = clock();
-    simpleMultiplyCPU_fp64(C_cpu, *Acols, *Arows, *Bcols,*Brows, A, B);
-    stoptime(start, "CPU: Multiply Matrices");
+    printf("Multiplying in %s\n", prec->name);
+    int rep;
+    double call_start, call_time, first_call = 0.0, steady = 0.0;
+    double kernel_time = 0.0;
+
+    int* Arows = (int *) malloc(sizeof(int));
+    int* Acols = (int *) malloc(sizeof(int));
+    int* Brows = (int *) malloc(sizeof(int));
+    int* Bcols = (int *) malloc(sizeof(int));
+
+    MatrixFile mfA, mfB;
+    openMatrixFile(Afile, prec->dtype, &mfA);
+    openMatrixFile(Bfile, prec->dtype, &mfB);
+    *Arows = mfA.rows; *Acols = mfA.cols;
+    *Brows = mfB.rows; *Bcols = mfB.cols;
+    // From here on the dimensions are those of op(A) and op(B)
+    if (transA)
+    {
+        *Arows = mfA.cols; *Acols = mfA.rows;
+    }
+    if (transB)
+    {
+        *Brows = mfB.cols; *Bcols = mfB.rows;
+    }
+    if (*Acols != *Brows)
+    {
+        printf("Can't multiply %d x %d by %d x %d\n", *Arows, *Acols, *Brows,
+                *Bcols);
+        exit(1);
+    }
+    void* A = mfA.data;  // Input array
+    void* B = mfB.data;  // Input array
+
+    size_t Cdatasize = prec->elsize*(size_t) (*Arows)*(*Bcols);
+
+    // Page aligned so a zero-copy device can write it in place
+    void* C = oclHostAlloc(Cdatasize, -1);  // Output array
+
+    if (!host_only && (epilogueActive() || transA || transB || colmajor) &&
+            (multidevice || pipeline > 0 ||
+             ooc_budget(oclRuntime(), prec->elsize, *Arows, *Acols, *Bcols) > 0))
+    {
+        printf("The epilogue and layout flags only apply to the "
+                "single-device multiply\n");
+        exit(1);
+    }
+
+    // Starting C for a beta epilogue, restored before every call
+    void* C0 = NULL;
+    if (epilogueActive())
+    {
+        C0 = calloc((size_t) (*Arows)*(*Bcols), prec->elsize);
+        if (Cfile != NULL)
+        {
+            MatrixFile mfC;
+            openMatrixFile(Cfile, prec->dtype, &mfC);
+            if (mfC.rows != *Arows || mfC.cols != *Bcols)
+            {
+                printf("C must be %d x %d\n", *Arows, *Bcols);
+                exit(1);
+            }
+            memcpy(C0, mfC.data, Cdatasize);
+            closeMatrixFile(&mfC);
+        }
+    }
 
-    int result = 1;
-    int idx;
-    double diff;
+    // A mostly-zero A goes to the sparse kernels, which only run the plain
+    // row-major product.
+    SparseMatrix spA;
+    memset(&spA, 0, sizeof(spA));
+    int sparse_forced = (strcmp(sparse_mode, "csr") == 0 ||
+            strcmp(sparse_mode, "ell") == 0);
+    int sparse_ok = !(epilogueActive() || transA || transB || colmajor ||
+            multidevice || pipeline > 0 || host_only);
+    if (sparse_forced && !sparse_ok)
+    {
+        printf("The sparse path needs a device and does not take the "
+                "epilogue, layout, pipeline or multi-device flags\n");
+        exit(1);
+    }
+    if (sparse_ok && strcmp(sparse_mode, "dense") != 0)
+    {
+        // One pass counts the nonzeros and, below the density threshold,
+        // a second builds the CSR copy; a dense A is only scanned once.
+        int sparse = denseToCsr(A, *Arows, *Acols, prec->dtype,
+                sparse_forced ? 1.0 : density, &spA);
+        printf("A is %.2f%% nonzero\n",
+                100.0*spA.nnz/((double) (*Arows)*(*Acols)));
+        if (sparse)
+        {
+            int format = (sparse_forced ? (strcmp(sparse_mode, "ell") == 0 ?
+                    SPARSE_ELL : SPARSE_CSR) : sparseChooseFormat(&spA));
+            if (format == SPARSE_ELL)
+            {
+                SparseMatrix ell;
+                csrToEll(&spA, &ell);
+                freeSparseMatrix(&spA);
+                spA = ell;
+            }
+            printf("Using the sparse %s multiply: %.2f MB for A instead of %.2f MB\n",
+                    format == SPARSE_ELL ? "ELL" : "CSR", sparseBytes(&spA)/1e6,
+                    prec->elsize*(double) (*Arows)*(*Acols)/1e6);
+        }
+    }
+    int use_sparse = (spA.format != 0);
 
-    for (idx = 0; idx < (*Arows)*(*Bcols); idx ++)
+    MatmultConfig cfg = config;
+    if (!use_sparse && !host_only)
     {
-        diff = C[idx] - C_cpu[idx];
-        if (diff < 0) diff *= -1;
-        if (diff > 0.01)
+        cfg = choose_config(oclRuntime(), C, A, B, *Arows, *Acols, *Brows,
+                *Bcols);
+    }
+
+    for (rep = 0; rep < repeat; rep++)
+    {
+        if (C0 != NULL)
+        {
+            memcpy(C, C0, Cdatasize);
+        }
+        call_start = walltime();
+        size_t stream_budget = (host_only ? 0 : ooc_budget(oclRuntime(),
+                prec->elsize, *Arows, *Acols, *Bcols));
+        if (host_only)
+        {
+            kernel_time = multiply_host(C, A, B, *Arows, *Acols, *Bcols, C0);
+        }
+        else if (use_sparse)
+        {
+            kernel_time = multiply_sparse(oclRuntime(), C, &spA, B, *Bcols);
+        }
+        else if (multidevice)
         {
-            result = 0;
-            printf("Breaking, index = %d\n", idx);
-            printf("Total Data size is = %d\n", (*Arows)*(*Bcols));
-            printf("OCL: %f\n", C[idx]);
-            printf("CPU: %f\n", C_cpu[idx]);
+            kernel_time = multiply_multidevice(prec->elsize, C, A, B, *Arows, *Acols,
+                    *Bcols);
+        }
+        else if (stream_budget > 0)
+        {
+            kernel_time = multiply_ooc(oclRuntime(), &cfg, prec->elsize, C, A, B, *Arows,
+                    *Acols, *Bcols, stream_budget);
+        }
+        else if (pipeline > 0)
+        {
+            kernel_time = multiply_pipelined(oclRuntime(), &cfg, prec->elsize, C, A, B,
+                    *Arows, *Acols, *Bcols, pipeline);
+        }
+        else if ((kernel_time = multiply(oclRuntime(), &cfg, C, A, B, *Arows,
+                    *Acols, *Brows, *Bcols)) < 0)
+        {
+            exit(1);
+        }
+        call_time = walltime() - call_start;
+        printf("Call %d wall time: %.3lf ms\n", rep + 1, call_time*1e3);
+        if (rep == 0)
+        {
+            first_call = call_time;
+        }
+        else
+        {
+            steady += call_time;
+        }
+    }
+    if (repeat > 1)
+    {
+        printf("First call: %.3lf ms, steady state: %.3lf ms per call\n",
+                first_call*1e3, steady*1e3/(repeat - 1));
+    }
+    // Only the nonzeros count for the sparse path
+    double flops = 2.0*(use_sparse ? spA.nnz : (double) (*Arows)*(*Acols))*(*Bcols);
+    printf("Kernel: %.3lf ms, %.2lf GFLOP/s (%.2lf GFLOP/s wall)\n",
+            kernel_time*1e3, flops/kernel_time*1e-9, flops/call_time*1e-9);
+
+    void* C_cpu = malloc(Cdatasize);
+    size_t n = (size_t) (*Arows)*(*Bcols);
+    if (vopts.sample > 0 && vopts.sample < n)
+    {
+        double sample_start = walltime();
+        multiply_host_sampled(C_cpu, A, B, *Arows, *Acols, *Bcols, C0,
+                vopts.sample, n/vopts.sample);
+        printf("CPU: %zu sampled elements in %.3lf ms\n", vopts.sample,
+                (walltime() - sample_start)*1e3);
+    }
+    else
+    {
+        double host_time = multiply_host(C_cpu, A, B, *Arows, *Acols, *Bcols,
+                C0);
+        printf("CPU: Multiply Matrices in %.3lf ms (%s, %d threads)\n",
+                host_time*1e3, cpuGemmIsa(), cpuGemmThreads());
+    }
+
+    VerifyResult check;
+    int result = verifyArrays(C, C_cpu, n, prec->dtype, &vopts, &check);
+    verifyReport(&check, C, C_cpu, prec->dtype, &vopts);
 
-            break;
+    // A -budget that forces streaming is also checked against the in-core
+    // multiply of the same problem, so the panel bookkeeping is exercised
+    // on matrices that would otherwise fit.
+    if (budget > 0 && !host_only && !use_sparse && !multidevice)
+    {
+        void* C_in = oclHostAlloc(Cdatasize, -1);
+        if (multiply(oclRuntime(), &cfg, C_in, A, B, *Arows, *Acols, *Brows,
+                    *Bcols) < 0)
+        {
+            exit(1);
         }
+        VerifyResult ooc_check;
+        int ooc_ok = verifyArrays(C, C_in, n, prec->dtype, &vopts, &ooc_check);
+        printf("Out-of-core vs in-core: ");
+        verifyReport(&ooc_check, C, C_in, prec->dtype, &vopts);
+        printf("Out-of-core result %s the in-core one\n",
+                ooc_ok ? "matches" : "differs from");
+        result = result && ooc_ok;
+        oclHostFree(C_in, Cdatasize);
     }
+
     if(result) {
         printf("Output is correct\n");
     } else {
         printf("Output is incorrect\n");
     }
 
-    // Free OpenCL resources
-    clReleaseKernel(kernel[0]);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(cmdQueue);
-    clReleaseMemObject(bufA);
-    clReleaseMemObject(bufB);
-    clReleaseMemObject(bufC);
+    // Free host resources
+    closeMatrixFile(&mfA);
+    closeMatrixFile(&mfB);
+    freeSparseMatrix(&spA);
+    oclHostFree(C, Cdatasize);
+    free(C_cpu);
+    free(C0);
+
+    // Non-zero exit status on a wrong result, for scripts like check_ooc
+    return(result ? 0 : 1);
+}
 
-    clReleaseContext(context);
+// A holds count products of batch rows stacked on top of each other; B is
+// either the same stack of K-row matrices or a single K x N matrix shared
+// by all of them. The products are run in one batched launch and then one
+// at a time through the single multiply path for comparison.
+int run_batched()
+{
+    MatrixFile mfA, mfB;
+    int b, rep;
+    double start, batched_wall = 0.0, batched_kernel = 0.0, looped = 0.0;
+    openMatrixFile(Afile, prec->dtype, &mfA);
+    openMatrixFile(Bfile, prec->dtype, &mfB);
 
-    // Free host resources
-    free(A);
-    free(B);
-    free(C);
+    if (epilogueActive() || transA || transB || colmajor)
+    {
+        printf("The epilogue and layout flags only apply to the "
+                "single-device multiply\n");
+        exit(1);
+    }
+    int M = batch, K = mfA.cols, N = mfB.cols;
+    int count = mfA.rows/M;
+    int strideB = (mfB.rows == K ? 0 : K*N);
+    if (mfA.rows % M != 0 || (strideB != 0 && mfB.rows != count*K))
+    {
+        printf("Inputs are not a stack of %d products of %d rows\n", count, M);
+        exit(1);
+    }
+    printf("Batch of %d products in %s, %s B\n", count, prec->name,
+            strideB == 0 ? "shared" : "packed");
+
+    size_t Cdatasize = prec->elsize*(size_t) count*M*N;
+    void* C = oclHostAlloc(Cdatasize, -1);
+    void* C_loop = malloc(Cdatasize);
+    OclRuntime* rt = oclRuntime();
+    MatmultConfig cfg = config;
+
+    for (rep = 0; rep < repeat + 1; rep++)
+    {
+        // the first run builds the program and is not counted
+        start = walltime();
+        double k = multiply_batched(rt, C, mfA.data, mfB.data, count, M, K,
+                N, M*K, strideB, M*N);
+        if (rep > 0)
+        {
+            batched_wall += walltime() - start;
+            batched_kernel += k;
+        }
+        verbose = 0;
+    }
+
+    for (rep = 0; rep < repeat + 1; rep++)
+    {
+        start = walltime();
+        for (b = 0; b < count; b++)
+        {
+            if (multiply(rt, &cfg, (char*) C_loop + prec->elsize*b*M*N,
+                        (char*) mfA.data + prec->elsize*b*M*K,
+                        (char*) mfB.data + prec->elsize*b*strideB,
+                        M, K, K, N) < 0)
+            {
+                exit(1);
+            }
+        }
+        if (rep > 0)
+        {
+            looped += walltime() - start;
+        }
+    }
+    verbose = 1;
+
+    batched_wall /= repeat;
+    batched_kernel /= repeat;
+    looped /= repeat;
+    printf("Batched: %.3lf ms (kernel %.3lf ms), %.0lf matrices/s\n",
+            batched_wall*1e3, batched_kernel*1e3, count/batched_wall);
+    printf("Looped:  %.3lf ms, %.0lf matrices/s\n", looped*1e3,
+            count/looped);
+    printf("Batched speedup: %.1lfx\n", looped/batched_wall);
+
+    void* C_cpu = malloc(Cdatasize);
+    for (b = 0; b < count; b++)
+    {
+        simpleMultiplyCPU((char*) C_cpu + prec->elsize*b*M*N, K, M, N, K,
+                (char*) mfA.data + prec->elsize*b*M*K,
+                (char*) mfB.data + prec->elsize*b*strideB);
+    }
+    VerifyResult check;
+    printf("Batched: ");
+    int result = verifyArrays(C, C_cpu, (size_t) count*M*N, prec->dtype,
+            &vopts, &check);
+    verifyReport(&check, C, C_cpu, prec->dtype, &vopts);
+    printf("Looped: ");
+    result &= verifyArrays(C_loop, C_cpu, (size_t) count*M*N, prec->dtype,
+            &vopts, &check);
+    verifyReport(&check, C_loop, C_cpu, prec->dtype, &vopts);
+    if(result) {
+        printf("Output is correct\n");
+    } else {
+        printf("Output is incorrect\n");
+    }
 
+    closeMatrixFile(&mfA);
+    closeMatrixFile(&mfB);
+    oclHostFree(C, Cdatasize);
+    free(C_loop);
+    free(C_cpu);
     return 0;
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    int supports_double = supportsDouble();
-    if (supports_double) return(main_fp64());
-    return(main_fp());
+    int i, nfiles = 0, ret;
+    verifyDefaults(&vopts);
+    for (i = 1; i < argc; i++)
+    {
+        if (verifyOption(argc, argv, &i, &vopts))
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+        {
+            repeat = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-kernel") == 0 && i + 1 < argc)
+        {
+            strncpy(config.variant, argv[++i], sizeof(config.variant) - 1);
+            config_given = 1;
+        }
+        else if (strcmp(argv[i], "-ls") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &config.ls, &config.lsy) < 2)
+            {
+                config.lsy = 0;
+            }
+            config_given = 1;
+        }
+        else if (strcmp(argv[i], "-wpt") == 0 && i + 1 < argc)
+        {
+            config.wpt = atoi(argv[++i]);
+            config_given = 1;
+        }
+        else if (strcmp(argv[i], "-precision") == 0 && i + 1 < argc)
+        {
+            unsigned int p;
+            i++;
+            for (p = 0; p < NUM_PRECISIONS; p++)
+            {
+                if (strcmp(argv[i], precisions[p].name) == 0)
+                {
+                    prec = &precisions[p];
+                }
+            }
+            if (prec == NULL)
+            {
+                printf("Unknown precision %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-alpha") == 0 && i + 1 < argc)
+        {
+            epilogue.alpha = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-beta") == 0 && i + 1 < argc)
+        {
+            epilogue.beta = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bias") == 0 && i + 1 < argc)
+        {
+            epilogue.bias = atof(argv[++i]);
+            epilogue.has_bias = 1;
+        }
+        else if (strcmp(argv[i], "-activation") == 0 && i + 1 < argc)
+        {
+            strncpy(epilogue.activation, argv[++i],
+                    sizeof(epilogue.activation) - 1);
+        }
+        else if (strcmp(argv[i], "-transA") == 0)
+        {
+            transA = 1;
+        }
+        else if (strcmp(argv[i], "-transB") == 0)
+        {
+            transB = 1;
+        }
+        else if (strcmp(argv[i], "-colmajor") == 0)
+        {
+            colmajor = 1;
+        }
+        else if (strcmp(argv[i], "-cfile") == 0 && i + 1 < argc)
+        {
+            Cfile = argv[++i];
+        }
+        else if (strcmp(argv[i], "-sparse") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "auto") != 0 && strcmp(argv[i], "dense") != 0 &&
+                    strcmp(argv[i], "csr") != 0 && strcmp(argv[i], "ell") != 0)
+            {
+                printf("Unknown sparse mode %s\n", argv[i]);
+                exit(1);
+            }
+            strcpy(sparse_mode, argv[i]);
+        }
+        else if (strcmp(argv[i], "-density") == 0 && i + 1 < argc)
+        {
+            density = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+        {
+            batch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-host") == 0)
+        {
+            host_only = 1;
+        }
+        else if (strcmp(argv[i], "-tune") == 0)
+        {
+            tune = 1;
+        }
+        else if (strcmp(argv[i], "-pipeline") == 0 && i + 1 < argc)
+        {
+            pipeline = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-multidevice") == 0)
+        {
+            multidevice = 1;
+        }
+        else if (strcmp(argv[i], "-numa") == 0)
+        {
+            numa = 1;
+            multidevice = 1;
+        }
+        else if (strcmp(argv[i], "-split") == 0 && i + 1 < argc)
+        {
+            split = atoi(argv[++i]);
+            multidevice = 1;
+        }
+        else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc)
+        {
+            char* unit;
+            budget = strtoul(argv[++i], &unit, 10);
+            if (*unit == 'K' || *unit == 'k') budget <<= 10;
+            if (*unit == 'M' || *unit == 'm') budget <<= 20;
+            if (*unit == 'G' || *unit == 'g') budget <<= 30;
+        }
+        else if (nfiles == 0)
+        {
+            Afile = argv[i];
+            nfiles++;
+        }
+        else if (nfiles == 1)
+        {
+            Bfile = argv[i];
+            nfiles++;
+        }
+    }
+    if (!host_only && !oclDeviceAvailable())
+    {
+        printf("No OpenCL device found, multiplying on the host\n");
+        host_only = 1;
+    }
+    if (host_only && (batch > 0 || multidevice || pipeline > 0))
+    {
+        printf("-batch, -pipeline and -multidevice need an OpenCL device\n");
+        exit(1);
+    }
+    // The host GEMM runs every precision
+    int supports_double = (host_only ? 1 : supportsDouble());
+    if (prec == NULL)
+    {
+        prec = &precisions[supports_double ? 1 : 0];
+    }
+    else if (prec->needs_fp64 && !supports_double)
+    {
+        if (strcmp(prec->name, "mixed") != 0)
+        {
+            printf("Device has no double precision support\n");
+            exit(1);
+        }
+        printf("No fp64 for mixed precision, using Kahan summation\n");
+        prec = &precisions[3];
+    }
+    ret = (batch > 0 ? run_batched() : run_matmult());
+    for (i = 0; i < md_count; i++)
+    {
+        oclFreeRuntime(md_runtimes[i]);
+    }
+    oclReleaseRuntime();
+    return(ret);
 }
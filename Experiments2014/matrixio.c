@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "matrixio.h"
+
+float* readDataFile(char fn[], int *mnum, int *nnum ){
+      /* first row of input file contains two ints: num rows and num cols */
+      /* rest of input file is data vals in row major order */
+      int status;
+      int size;
+      float *data;
+      int m,n,i;
+      FILE* fp;
+      fp=fopen(fn,"r");
+      if (!fp)
+      {
+          printf("Error opening file\n");
+          exit(-1);
+      }
+      status = fseek(fp, 0, SEEK_END);
+      if (status != 0)
+      {
+          printf("Error seeking end of file\n");
+          exit(-1);
+      }
+      size = ftell(fp);
+      if (size<0)
+      {
+          printf("Error getting file position\n");
+          exit(-1);
+      }
+
+      rewind(fp);
+
+      fscanf(fp,"%d %d",&m, &n);
+      printf("Rows: %d, Columns:  %d\n", m, n);
+      data=malloc(sizeof(float)*m*n); //
+      for (i=0;i<m*n;i++)
+      fscanf(fp,"%f",&data[i]);
+      fclose(fp);
+      *mnum = m;  // store 'm' where the caller can see it
+      *nnum = n;  // store 'n' where the caller can see it
+      return(data);
+}
+
+double* readDataFileDouble(char fn[], int *mnum, int *nnum ){
+
+      /* first row of input file contains two ints: num rows and num cols */
+      /* rest of input file is data vals in row major order */
+      int status;
+      int size;
+      double *data;
+      int m,n,i;
+      FILE* fp;
+      fp=fopen(fn,"r");
+      if (!fp)
+      {
+          printf("Error opening file\n");
+          exit(-1);
+      }
+      status = fseek(fp, 0, SEEK_END);
+      if (status != 0)
+      {
+          printf("Error seeking end of file\n");
+          exit(-1);
+      }
+      size = ftell(fp);
+      if (size<0)
+      {
+          printf("Error getting file position\n");
+          exit(-1);
+      }
+
+      rewind(fp);
+
+      fscanf(fp,"%d %d",&m, &n);
+      printf("Rows: %d, Columns:  %d\n", m, n);
+      data=malloc(sizeof(double)*m*n); //
+      for (i=0;i<m*n;i++)
+      fscanf(fp,"%lf",&data[i]);
+      fclose(fp);
+      *mnum = m;  // store 'm' where the caller can see it
+      *nnum = n;  // store 'n' where the caller can see it
+      return(data);
+}
+
+size_t matrixElementSize(int dtype)
+{
+    return(dtype == MATRIX_DOUBLE ? sizeof(double) : sizeof(float));
+}
+
+int isBinaryMatrixFile(const char* fn)
+{
+    char magic[4];
+    FILE* fp = fopen(fn, "rb");
+    if (!fp)
+    {
+        return(0);
+    }
+    size_t n = fread(magic, 1, 4, fp);
+    fclose(fp);
+    return(n == 4 && memcmp(magic, MATRIX_MAGIC, 4) == 0);
+}
+
+int writeMatrixFile(const char* fn, const void* data, int rows, int cols,
+        int dtype, int alignment)
+{
+    MatrixHeader hdr;
+    size_t elsize = matrixElementSize(dtype);
+    size_t count = (size_t) rows * cols;
+    FILE* fp;
+    if (alignment <= 0)
+    {
+        alignment = MATRIX_DEFAULT_ALIGN;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MATRIX_MAGIC, 4);
+    hdr.version = MATRIX_VERSION;
+    hdr.rows = rows;
+    hdr.cols = cols;
+    hdr.dtype = dtype;
+    hdr.alignment = alignment;
+    hdr.data_offset = ((sizeof(hdr) + alignment - 1)/alignment)*alignment;
+
+    fp = fopen(fn, "wb");
+    if (!fp)
+    {
+        printf("Error opening %s for writing\n", fn);
+        return(-1);
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    size_t pos;
+    for (pos = sizeof(hdr); pos < hdr.data_offset; pos++)
+    {
+        fputc(0, fp);
+    }
+    if (fwrite(data, elsize, count, fp) != count)
+    {
+        printf("Error writing %s\n", fn);
+        fclose(fp);
+        return(-1);
+    }
+    fclose(fp);
+    return(0);
+}
+
+// Convert count values between float and double.
+static void* convertMatrixData(const void* src, size_t count, int from, int to)
+{
+    size_t i;
+    void* dst = malloc(matrixElementSize(to)*count);
+    if (dst == NULL)
+    {
+        printf("Error allocating converted matrix\n");
+        exit(-1);
+    }
+    for (i = 0; i < count; i++)
+    {
+        double v = (from == MATRIX_DOUBLE ? ((const double*) src)[i]
+                : ((const float*) src)[i]);
+        if (to == MATRIX_DOUBLE)
+        {
+            ((double*) dst)[i] = v;
+        }
+        else
+        {
+            ((float*) dst)[i] = (float) v;
+        }
+    }
+    return(dst);
+}
+
+static void mapMatrixFile(const char* fn, MatrixFile* mf)
+{
+    struct stat st;
+    MatrixHeader* hdr;
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Error opening file\n");
+        exit(-1);
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(MatrixHeader))
+    {
+        printf("Error reading size of %s\n", fn);
+        exit(-1);
+    }
+    // MAP_PRIVATE so callers may scribble on the data without touching the
+    // file.
+    mf->maplen = st.st_size;
+    mf->map = mmap(NULL, mf->maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, 0);
+    close(fd);
+    if (mf->map == MAP_FAILED)
+    {
+        printf("Error mapping %s\n", fn);
+        exit(-1);
+    }
+
+    hdr = (MatrixHeader*) mf->map;
+    if (hdr->version != MATRIX_VERSION ||
+            (hdr->dtype != MATRIX_FLOAT && hdr->dtype != MATRIX_DOUBLE) ||
+            hdr->rows > 0x7fffffff || hdr->cols > 0x7fffffff ||
+            hdr->data_offset > mf->maplen ||
+            (hdr->cols > 0 && hdr->rows > (mf->maplen - hdr->data_offset)/
+                hdr->cols/matrixElementSize(hdr->dtype)))
+    {
+        printf("Corrupt or unsupported matrix file %s\n", fn);
+        exit(-1);
+    }
+    mf->rows = hdr->rows;
+    mf->cols = hdr->cols;
+    mf->dtype = hdr->dtype;
+    mf->data = (char*) mf->map + hdr->data_offset;
+    madvise(mf->map, mf->maplen, MADV_SEQUENTIAL);
+}
+
+// Load a matrix from either the binary container (memory mapped) or the
+// "rows cols\n values" text format. The result always has element type
+// dtype; a binary file of the other precision is converted on the heap.
+void openMatrixFile(const char* fn, int dtype, MatrixFile* mf)
+{
+    memset(mf, 0, sizeof(*mf));
+    if (isBinaryMatrixFile(fn))
+    {
+        mapMatrixFile(fn, mf);
+        printf("Rows: %d, Columns:  %d\n", mf->rows, mf->cols);
+        if (mf->dtype != dtype)
+        {
+            void* converted = convertMatrixData(mf->data,
+                    (size_t) mf->rows*mf->cols, mf->dtype, dtype);
+            munmap(mf->map, mf->maplen);
+            mf->map = NULL;
+            mf->maplen = 0;
+            mf->data = converted;
+            mf->dtype = dtype;
+        }
+        return;
+    }
+
+    mf->dtype = dtype;
+    if (dtype == MATRIX_DOUBLE)
+    {
+        mf->data = readDataFileDouble((char*) fn, &mf->rows, &mf->cols);
+    }
+    else
+    {
+        mf->data = readDataFile((char*) fn, &mf->rows, &mf->cols);
+    }
+}
+
+void closeMatrixFile(MatrixFile* mf)
+{
+    if (mf->map != NULL)
+    {
+        munmap(mf->map, mf->maplen);
+    }
+    else
+    {
+        free(mf->data);
+    }
+    memset(mf, 0, sizeof(*mf));
+}
@@ -0,0 +1,53 @@
+#ifndef MATRIXIO_H
+#define MATRIXIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary matrix container. A 64 byte header is followed (at data_offset,
+// a multiple of alignment) by rows*cols values in row major order.
+// Integers are stored little endian.
+#define MATRIX_MAGIC "OCLM"
+#define MATRIX_VERSION 1
+#define MATRIX_FLOAT 1
+#define MATRIX_DOUBLE 2
+// Page aligned data stays aligned once mapped, which meets any
+// CL_DEVICE_MEM_BASE_ADDR_ALIGN and lets mapped inputs be used zero-copy.
+#define MATRIX_DEFAULT_ALIGN 4096
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t rows;
+    uint64_t cols;
+    uint32_t dtype;
+    uint32_t alignment;
+    uint64_t data_offset;
+    char reserved[24];
+} MatrixHeader;
+
+// A matrix loaded by openMatrixFile. When map is not NULL, data points
+// into a private memory mapping of the file; otherwise data is on the heap.
+// Either way closeMatrixFile releases it.
+typedef struct
+{
+    int rows;
+    int cols;
+    int dtype;
+    void* data;
+    void* map;
+    size_t maplen;
+} MatrixFile;
+
+float* readDataFile(char fn[], int *mnum, int *nnum);
+double* readDataFileDouble(char fn[], int *mnum, int *nnum);
+
+size_t matrixElementSize(int dtype);
+int isBinaryMatrixFile(const char* fn);
+int writeMatrixFile(const char* fn, const void* data, int rows, int cols,
+        int dtype, int alignment);
+void openMatrixFile(const char* fn, int dtype, MatrixFile* mf);
+void closeMatrixFile(MatrixFile* mf);
+
+#endif
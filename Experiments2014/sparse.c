@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrixio.h"
+#include "sparse.h"
+
+static double valueAt(const void* p, size_t i, int dtype)
+{
+    return(dtype == MATRIX_DOUBLE ? ((const double*) p)[i]
+            : ((const float*) p)[i]);
+}
+
+static void setValue(void* p, size_t i, int dtype, double v)
+{
+    if (dtype == MATRIX_DOUBLE)
+    {
+        ((double*) p)[i] = v;
+    }
+    else
+    {
+        ((float*) p)[i] = (float) v;
+    }
+}
+
+static void* allocOrDie(size_t bytes)
+{
+    void* p = malloc(bytes > 0 ? bytes : 1);
+    if (p == NULL)
+    {
+        printf("Error allocating sparse matrix\n");
+        exit(-1);
+    }
+    return(p);
+}
+
+size_t sparseCountNonzeros(const void* data, int rows, int cols, int dtype)
+{
+    size_t i, n = (size_t) rows*cols, nnz = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (valueAt(data, i, dtype) != 0.0)
+        {
+            nnz++;
+        }
+    }
+    return(nnz);
+}
+
+// Convert a dense row major matrix (as read by openMatrixFile) to CSR.
+// Returns 0 when more than threshold of the entries are nonzero; sp then
+// has no format or arrays, only rows, cols and nnz for the caller to report,
+// and the caller keeps the dense path.
+int denseToCsr(const void* data, int rows, int cols, int dtype,
+        double threshold, SparseMatrix* sp)
+{
+    int r, c, k = 0;
+    size_t nnz = sparseCountNonzeros(data, rows, cols, dtype);
+    memset(sp, 0, sizeof(*sp));
+    sp->rows = rows;
+    sp->cols = cols;
+    sp->nnz = nnz;
+    sp->dtype = dtype;
+    if (nnz > threshold*rows*cols)
+    {
+        return(0);
+    }
+
+    sp->format = SPARSE_CSR;
+    sp->row_ptr = allocOrDie(sizeof(int)*(rows + 1));
+    sp->col_idx = allocOrDie(sizeof(int)*nnz);
+    sp->values = allocOrDie(matrixElementSize(dtype)*nnz);
+    for (r = 0; r < rows; r++)
+    {
+        sp->row_ptr[r] = k;
+        for (c = 0; c < cols; c++)
+        {
+            double v = valueAt(data, (size_t) r*cols + c, dtype);
+            if (v != 0.0)
+            {
+                sp->col_idx[k] = c;
+                setValue(sp->values, k, dtype, v);
+                k++;
+            }
+        }
+    }
+    sp->row_ptr[rows] = k;
+    return(1);
+}
+
+// Entries in the longest row, the width an ELL copy pads every row to.
+static int longestRow(const SparseMatrix* csr)
+{
+    int r, width = 0;
+    for (r = 0; r < csr->rows; r++)
+    {
+        int len = csr->row_ptr[r + 1] - csr->row_ptr[r];
+        if (len > width) width = len;
+    }
+    return(width);
+}
+
+void csrToEll(const SparseMatrix* csr, SparseMatrix* ell)
+{
+    int r, j, width = longestRow(csr);
+
+    memset(ell, 0, sizeof(*ell));
+    ell->format = SPARSE_ELL;
+    ell->rows = csr->rows;
+    ell->cols = csr->cols;
+    ell->nnz = csr->nnz;
+    ell->dtype = csr->dtype;
+    ell->width = width;
+    ell->col_idx = allocOrDie(sizeof(int)*(size_t) width*csr->rows);
+    ell->values = allocOrDie(matrixElementSize(csr->dtype)*(size_t) width*csr->rows);
+    for (r = 0; r < csr->rows; r++)
+    {
+        int start = csr->row_ptr[r], len = csr->row_ptr[r + 1] - start;
+        for (j = 0; j < width; j++)
+        {
+            size_t slot = (size_t) j*csr->rows + r;
+            ell->col_idx[slot] = (j < len ? csr->col_idx[start + j] : -1);
+            setValue(ell->values, slot, csr->dtype,
+                    j < len ? valueAt(csr->values, start + j, csr->dtype) : 0.0);
+        }
+    }
+}
+
+// ELL when the rows are even enough that padding them to the longest one
+// stays cheap, CSR otherwise.
+int sparseChooseFormat(const SparseMatrix* csr)
+{
+    int width = longestRow(csr);
+    double average = (double) csr->nnz/(csr->rows > 0 ? csr->rows : 1);
+    return(width <= SPARSE_ELL_MAX_SKEW*average ? SPARSE_ELL : SPARSE_CSR);
+}
+
+// Bytes the device needs for the index and value arrays.
+size_t sparseBytes(const SparseMatrix* sp)
+{
+    size_t elsize = matrixElementSize(sp->dtype);
+    if (sp->format == SPARSE_ELL)
+    {
+        return((sizeof(int) + elsize)*(size_t) sp->width*sp->rows);
+    }
+    return(sizeof(int)*(sp->rows + 1) + (sizeof(int) + elsize)*(size_t) sp->nnz);
+}
+
+void freeSparseMatrix(SparseMatrix* sp)
+{
+    free(sp->row_ptr);
+    free(sp->col_idx);
+    free(sp->values);
+    memset(sp, 0, sizeof(*sp));
+}
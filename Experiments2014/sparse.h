@@ -0,0 +1,42 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stddef.h>
+
+#define SPARSE_CSR 1
+#define SPARSE_ELL 2
+// Inputs with at most this fraction of nonzeros go to the sparse kernels
+#define SPARSE_DEFAULT_THRESHOLD 0.05
+// ELL pads every row to the longest one; beyond this ratio of longest to
+// average row the padding costs more than CSR's uncoalesced reads.
+#define SPARSE_ELL_MAX_SKEW 2.0
+
+// A sparse matrix with values of element type dtype (MATRIX_FLOAT or
+// MATRIX_DOUBLE).
+//   CSR: row r has entries row_ptr[r] .. row_ptr[r + 1] - 1 of col_idx and
+//        values.
+//   ELL: every row has width entries, stored slot by slot (entry j of row r
+//        at j*rows + r) so neighbouring rows are adjacent in memory. Padding
+//        entries have col_idx -1 and value 0.
+typedef struct
+{
+    int format;
+    int rows;
+    int cols;
+    int nnz;
+    int dtype;
+    int width;
+    int* row_ptr;
+    int* col_idx;
+    void* values;
+} SparseMatrix;
+
+size_t sparseCountNonzeros(const void* data, int rows, int cols, int dtype);
+int denseToCsr(const void* data, int rows, int cols, int dtype,
+        double threshold, SparseMatrix* sp);
+void csrToEll(const SparseMatrix* csr, SparseMatrix* ell);
+int sparseChooseFormat(const SparseMatrix* csr);
+size_t sparseBytes(const SparseMatrix* sp);
+void freeSparseMatrix(SparseMatrix* sp);
+
+#endif
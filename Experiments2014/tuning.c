@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tuning.h"
+
+#define TUNING_LINE 512
+#define TUNING_FIELDS 10
+
+const char* tuningDbFile()
+{
+    const char* fn = getenv("MATMULT_TUNING_DB");
+    return(fn != NULL ? fn : TUNING_DEFAULT_DB);
+}
+
+// Problems are grouped by the power of two just above their largest
+// dimension, so 1000x1000 and 1024x1024 share a configuration.
+int tuningSizeClass(int Arows, int Acols, int Bcols)
+{
+    int n = Arows;
+    int sizeclass = 0;
+    if (Acols > n) n = Acols;
+    if (Bcols > n) n = Bcols;
+    while ((1 << sizeclass) < n)
+    {
+        sizeclass++;
+    }
+    return(sizeclass);
+}
+
+// Split a database line in place; returns 1 when it has every field.
+static int parse_line(char* line, char** fields)
+{
+    int n = 0;
+    char* tok = strtok(line, ";\n");
+    while (tok != NULL && n < TUNING_FIELDS)
+    {
+        fields[n++] = tok;
+        tok = strtok(NULL, ";\n");
+    }
+    return(n == TUNING_FIELDS && tok == NULL);
+}
+
+static int same_key(char** fields, const char* device, const char* precision,
+        int sizeclass, const char* layout, const char* epilogue)
+{
+    return(strcmp(fields[0], device) == 0 &&
+            strcmp(fields[1], precision) == 0 &&
+            atoi(fields[2]) == sizeclass &&
+            strcmp(fields[3], layout) == 0 &&
+            strcmp(fields[4], epilogue) == 0);
+}
+
+int tuningLookup(const char* device, const char* precision, int sizeclass,
+        const char* layout, const char* epilogue, MatmultConfig* cfg)
+{
+    char line[TUNING_LINE];
+    char* fields[TUNING_FIELDS];
+    FILE* fp = fopen(tuningDbFile(), "r");
+    if (fp == NULL)
+    {
+        return(0);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (parse_line(line, fields) &&
+                same_key(fields, device, precision, sizeclass, layout, epilogue))
+        {
+            memset(cfg, 0, sizeof(*cfg));
+            strncpy(cfg->variant, fields[5], sizeof(cfg->variant) - 1);
+            cfg->ls = atoi(fields[6]);
+            cfg->lsy = atoi(fields[7]);
+            cfg->wpt = atoi(fields[8]);
+            fclose(fp);
+            return(1);
+        }
+    }
+    fclose(fp);
+    return(0);
+}
+
+// Rewrite the database with this entry replacing any previous one for the
+// same device, precision, size class, layout and epilogue.
+void tuningStore(const char* device, const char* precision, int sizeclass,
+        const char* layout, const char* epilogue, const MatmultConfig* cfg,
+        double ms)
+{
+    char line[TUNING_LINE], copy[TUNING_LINE];
+    char* fields[TUNING_FIELDS];
+    char tmpname[1024];
+    const char* fn = tuningDbFile();
+    FILE* in = fopen(fn, "r");
+    FILE* out;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", fn);
+    out = fopen(tmpname, "w");
+    if (out == NULL)
+    {
+        printf("Couldn't write tuning database %s\n", tmpname);
+        if (in != NULL) fclose(in);
+        return;
+    }
+    if (in != NULL)
+    {
+        while (fgets(line, sizeof(line), in) != NULL)
+        {
+            strcpy(copy, line);
+            if (parse_line(copy, fields) &&
+                    same_key(fields, device, precision, sizeclass, layout,
+                        epilogue))
+            {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s;%s;%d;%s;%s;%s;%d;%d;%d;%.4lf\n", device, precision,
+            sizeclass, layout, epilogue, cfg->variant, cfg->ls, cfg->lsy,
+            cfg->wpt, ms);
+    fclose(out);
+    rename(tmpname, fn);
+}
@@ -0,0 +1,29 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+// Launch configuration for the matmult kernels.
+typedef struct
+{
+    char variant[16];   // "tiled" or "regblock"
+    int ls;             // work-group side, 0 picks sqrt(max work-group size)
+    int wpt;            // regblock only: wpt x wpt outputs per work-item
+    int lsy;            // tiled only: work-group rows when not square, so
+                        // the group is ls wide by lsy high; 0 for ls x ls
+} MatmultConfig;
+
+// Tuning results are stored one per line as
+//   device;precision;size class;layout;epilogue;variant;ls;lsy;wpt;kernel ms
+// in MATMULT_TUNING_DB, or TUNING_DEFAULT_DB when that is unset. Layout and
+// epilogue name the kernel build (see tuning_key in matmult2.c), since
+// transposed loads and a fused epilogue change which configuration wins.
+#define TUNING_DEFAULT_DB "./matmult_tuning.db"
+
+const char* tuningDbFile();
+int tuningSizeClass(int Arows, int Acols, int Bcols);
+int tuningLookup(const char* device, const char* precision, int sizeclass,
+        const char* layout, const char* epilogue, MatmultConfig* cfg);
+void tuningStore(const char* device, const char* precision, int sizeclass,
+        const char* layout, const char* epilogue, const MatmultConfig* cfg,
+        double ms);
+
+#endif
@@ -0,0 +1,49 @@
+// Convert a "rows cols\n values" text matrix (as written by
+// writeMatrixToFile in hw4/matMult.R) to the binary container read by
+// openMatrixFile.
+//
+// usage: txt2bin.o in.txt out.bin [float|double] [alignment]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrixio.h"
+
+int main(int argc, char** argv)
+{
+    int rows, cols;
+    int dtype = MATRIX_FLOAT;
+    int alignment = MATRIX_DEFAULT_ALIGN;
+    void* data;
+
+    if (argc < 3)
+    {
+        printf("usage: %s in.txt out.bin [float|double] [alignment]\n", argv[0]);
+        return(1);
+    }
+    if (argc > 3 && strcmp(argv[3], "double") == 0)
+    {
+        dtype = MATRIX_DOUBLE;
+    }
+    if (argc > 4)
+    {
+        alignment = atoi(argv[4]);
+    }
+
+    if (dtype == MATRIX_DOUBLE)
+    {
+        data = readDataFileDouble(argv[1], &rows, &cols);
+    }
+    else
+    {
+        data = readDataFile(argv[1], &rows, &cols);
+    }
+    if (writeMatrixFile(argv[2], data, rows, cols, dtype, alignment) != 0)
+    {
+        return(1);
+    }
+    printf("Wrote %s (%d x %d, %s, %d byte aligned)\n", argv[2], rows, cols,
+            dtype == MATRIX_DOUBLE ? "double" : "float", alignment);
+    free(data);
+    return(0);
+}
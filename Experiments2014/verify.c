@@ -0,0 +1,301 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "verify.h"
+
+// Upper bounds of the relative error histogram bins after "exact"
+static const double hist_edges[VERIFY_HIST_BINS - 2] =
+    {1e-9, 1e-7, 1e-5, 1e-3, 1e-1};
+
+// One thread's slice: checked elements first .. last - 1, element s being
+// index s*stride of the arrays.
+typedef struct
+{
+    const void* out;
+    const void* ref;
+    int dtype;
+    const VerifyOptions* opt;
+    size_t first, last, stride;
+    double sum_abs, sum_rel;
+    VerifyResult res;
+} VerifyTask;
+
+void verifyDefaults(VerifyOptions* opt)
+{
+    opt->abs_tol = 0.01;
+    opt->rel_tol = 1e-4;
+    opt->ulp_tol = 0.0;
+    opt->sample = 0;
+    opt->offenders = 10;
+}
+
+// Consume a verifier flag at argv[*i] (-atol X, -rtol X, -ulps N,
+// -sample N, -offenders N), advancing *i past its value. Returns 0 when
+// argv[*i] is not one of them.
+int verifyOption(int argc, char** argv, int* i, VerifyOptions* opt)
+{
+    if (*i + 1 >= argc)
+    {
+        return(0);
+    }
+    if (strcmp(argv[*i], "-atol") == 0)
+    {
+        opt->abs_tol = atof(argv[++*i]);
+    }
+    else if (strcmp(argv[*i], "-rtol") == 0)
+    {
+        opt->rel_tol = atof(argv[++*i]);
+    }
+    else if (strcmp(argv[*i], "-ulps") == 0)
+    {
+        opt->ulp_tol = atof(argv[++*i]);
+    }
+    else if (strcmp(argv[*i], "-sample") == 0)
+    {
+        opt->sample = strtoul(argv[++*i], NULL, 10);
+    }
+    else if (strcmp(argv[*i], "-offenders") == 0)
+    {
+        opt->offenders = atoi(argv[++*i]);
+        if (opt->offenders > VERIFY_MAX_OFFENDERS)
+        {
+            opt->offenders = VERIFY_MAX_OFFENDERS;
+        }
+    }
+    else
+    {
+        return(0);
+    }
+    return(1);
+}
+
+static double valueAt(const void* p, size_t i, int dtype)
+{
+    if (dtype == VERIFY_DOUBLE)
+    {
+        return(((const double*) p)[i]);
+    }
+    if (dtype == VERIFY_INT)
+    {
+        return(((const int*) p)[i]);
+    }
+    return(((const float*) p)[i]);
+}
+
+// Representable values between out[i] and ref[i]: the IEEE bit patterns,
+// reordered so that they count up through the negatives and positives.
+static double ulpDistance(const void* out, const void* ref, size_t i, int dtype)
+{
+    if (dtype == VERIFY_FLOAT)
+    {
+        int32_t a, b;
+        memcpy(&a, (const float*) out + i, sizeof(a));
+        memcpy(&b, (const float*) ref + i, sizeof(b));
+        if (a < 0) a = INT32_MIN - a;
+        if (b < 0) b = INT32_MIN - b;
+        return(fabs((double) a - (double) b));
+    }
+    if (dtype == VERIFY_DOUBLE)
+    {
+        int64_t a, b;
+        memcpy(&a, (const double*) out + i, sizeof(a));
+        memcpy(&b, (const double*) ref + i, sizeof(b));
+        if (a < 0) a = INT64_MIN - a;
+        if (b < 0) b = INT64_MIN - b;
+        return(fabs((double) a - (double) b));
+    }
+    return(fabs(valueAt(out, i, dtype) - valueAt(ref, i, dtype)));
+}
+
+static void* verifyTask(void* arg)
+{
+    VerifyTask* t = (VerifyTask*) arg;
+    const VerifyOptions* opt = t->opt;
+    VerifyResult* res = &t->res;
+    size_t s;
+    int b;
+    for (s = t->first; s < t->last; s++)
+    {
+        size_t i = s*t->stride;
+        double o = valueAt(t->out, i, t->dtype);
+        double r = valueAt(t->ref, i, t->dtype);
+        double diff = fabs(o - r);
+        double rel = (r != 0.0 ? diff/fabs(r) : diff);
+        double ulp = ulpDistance(t->out, t->ref, i, t->dtype);
+        if (isnan(o) || isnan(r))
+        {
+            // matching NaNs are fine, anything else counts as infinitely off
+            diff = rel = ulp = (isnan(o) && isnan(r) ? 0.0 : INFINITY);
+        }
+        int pass = (diff <= opt->abs_tol + opt->rel_tol*fabs(r)) ||
+            (opt->ulp_tol > 0.0 && ulp <= opt->ulp_tol);
+
+        if (diff > res->max_abs) res->max_abs = diff;
+        if (rel > res->max_rel) res->max_rel = rel;
+        if (ulp > res->max_ulp) res->max_ulp = ulp;
+        t->sum_abs += diff;
+        t->sum_rel += rel;
+        for (b = 0; b < VERIFY_HIST_BINS - 2 && rel > hist_edges[b]; b++);
+        res->hist[rel == 0.0 ? 0 : b + 1]++;
+        if (!pass)
+        {
+            if (res->num_offenders < opt->offenders)
+            {
+                res->offender[res->num_offenders++] = i;
+            }
+            res->failed++;
+        }
+    }
+    res->checked = t->last - t->first;
+    return(NULL);
+}
+
+static int verifyThreads()
+{
+    static int threads = 0;
+    if (threads == 0)
+    {
+        const char* env = getenv("VERIFY_THREADS");
+        threads = (env != NULL ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN));
+        if (threads < 1)
+        {
+            threads = 1;
+        }
+    }
+    return(threads);
+}
+
+// Whether checks that run on every call of a library entry point (the R
+// bindings, each band of a stream) should be done: off unless VERIFY_RESULTS
+// is set to a nonzero value, so steady-state calls don't pay for a host
+// reference and a full comparison.
+int verifyEnabled()
+{
+    static int enabled = -1;
+    if (enabled < 0)
+    {
+        const char* env = getenv("VERIFY_RESULTS");
+        enabled = (env != NULL && atoi(env) != 0);
+    }
+    return(enabled);
+}
+
+// Compare n elements of out against ref, split over threads, and collect
+// the statistics in res. Returns 1 when every checked element passes.
+int verifyArrays(const void* out, const void* ref, size_t n, int dtype,
+        const VerifyOptions* opt, VerifyResult* res)
+{
+    size_t stride = 1, count = n;
+    int t, b, threads = verifyThreads();
+    if (opt->sample > 0 && opt->sample < n)
+    {
+        stride = n/opt->sample;
+        count = opt->sample;
+    }
+    if (count < VERIFY_MIN_PARALLEL)
+    {
+        threads = 1;
+    }
+
+    VerifyTask* tasks = calloc(threads, sizeof(VerifyTask));
+    pthread_t* ids = malloc(sizeof(pthread_t)*threads);
+    for (t = 0; t < threads; t++)
+    {
+        tasks[t].out = out;
+        tasks[t].ref = ref;
+        tasks[t].dtype = dtype;
+        tasks[t].opt = opt;
+        tasks[t].stride = stride;
+        tasks[t].first = count*t/threads;
+        tasks[t].last = count*(t + 1)/threads;
+    }
+    for (t = 1; t < threads; t++)
+    {
+        if (pthread_create(&ids[t], NULL, verifyTask, &tasks[t]) != 0)
+        {
+            printf("Error starting verify thread\n");
+            exit(-1);
+        }
+    }
+    verifyTask(&tasks[0]);
+
+    // Slices are in index order, so the first offenders of the earlier
+    // slices are the first offenders overall.
+    double sum_abs = 0.0, sum_rel = 0.0;
+    memset(res, 0, sizeof(*res));
+    for (t = 0; t < threads; t++)
+    {
+        const VerifyResult* part = &tasks[t].res;
+        if (t > 0)
+        {
+            pthread_join(ids[t], NULL);
+        }
+        res->checked += part->checked;
+        res->failed += part->failed;
+        if (part->max_abs > res->max_abs) res->max_abs = part->max_abs;
+        if (part->max_rel > res->max_rel) res->max_rel = part->max_rel;
+        if (part->max_ulp > res->max_ulp) res->max_ulp = part->max_ulp;
+        sum_abs += tasks[t].sum_abs;
+        sum_rel += tasks[t].sum_rel;
+        for (b = 0; b < VERIFY_HIST_BINS; b++)
+        {
+            res->hist[b] += part->hist[b];
+        }
+        for (b = 0; b < part->num_offenders &&
+                res->num_offenders < opt->offenders; b++)
+        {
+            res->offender[res->num_offenders++] = part->offender[b];
+        }
+    }
+    if (res->checked > 0)
+    {
+        res->mean_abs = sum_abs/res->checked;
+        res->mean_rel = sum_rel/res->checked;
+    }
+    free(tasks);
+    free(ids);
+    return(res->failed == 0);
+}
+
+void verifyReport(const VerifyResult* res, const void* out, const void* ref,
+        int dtype, const VerifyOptions* opt)
+{
+    static const char* labels[VERIFY_HIST_BINS] =
+        {"exact", "<= 1e-9", "<= 1e-7", "<= 1e-5", "<= 1e-3", "<= 1e-1",
+         "> 1e-1"};
+    int b;
+    printf("Checked %zu elements%s: %zu outside tolerance (abs %.1e, rel %.1e",
+            res->checked, opt->sample > 0 ? " (sampled)" : "", res->failed,
+            opt->abs_tol, opt->rel_tol);
+    if (opt->ulp_tol > 0.0)
+    {
+        printf(", %.0f ulps", opt->ulp_tol);
+    }
+    printf(")\n");
+    printf("Max error: abs %.3e, rel %.3e, %.0f ulps; mean abs %.3e, rel %.3e\n",
+            res->max_abs, res->max_rel, res->max_ulp, res->mean_abs,
+            res->mean_rel);
+    printf("Relative error histogram:");
+    for (b = 0; b < VERIFY_HIST_BINS; b++)
+    {
+        if (res->hist[b] > 0)
+        {
+            printf(" %s: %zu", labels[b], res->hist[b]);
+        }
+    }
+    printf("\n");
+    for (b = 0; b < res->num_offenders; b++)
+    {
+        size_t i = res->offender[b];
+        printf("  [%zu] got %.9g, expected %.9g\n", i, valueAt(out, i, dtype),
+                valueAt(ref, i, dtype));
+    }
+    if ((size_t) res->num_offenders < res->failed)
+    {
+        printf("  ... %zu more\n", res->failed - res->num_offenders);
+    }
+}
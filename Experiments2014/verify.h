@@ -0,0 +1,52 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+
+// Element types; float and double match matrixio's MATRIX_FLOAT and
+// MATRIX_DOUBLE so a matrix dtype can be passed straight through.
+#define VERIFY_FLOAT 1
+#define VERIFY_DOUBLE 2
+#define VERIFY_INT 3
+
+#define VERIFY_MAX_OFFENDERS 32
+// Relative error decades: exact, <= 1e-9, 1e-7, 1e-5, 1e-3, 1e-1, larger
+#define VERIFY_HIST_BINS 7
+// Outputs smaller than this are checked on one thread
+#define VERIFY_MIN_PARALLEL (1 << 16)
+
+// An element passes when |out - ref| <= abs_tol + rel_tol*|ref|, or when
+// ulp_tol > 0 and the two are at most ulp_tol representable values apart.
+// With sample > 0 only that many evenly spaced elements are checked.
+typedef struct
+{
+    double abs_tol;
+    double rel_tol;
+    double ulp_tol;
+    size_t sample;
+    int offenders;
+} VerifyOptions;
+
+typedef struct
+{
+    size_t checked;
+    size_t failed;
+    double max_abs;
+    double max_rel;
+    double max_ulp;
+    double mean_abs;
+    double mean_rel;
+    size_t hist[VERIFY_HIST_BINS];
+    int num_offenders;
+    size_t offender[VERIFY_MAX_OFFENDERS];
+} VerifyResult;
+
+void verifyDefaults(VerifyOptions* opt);
+int verifyEnabled();
+int verifyOption(int argc, char** argv, int* i, VerifyOptions* opt);
+int verifyArrays(const void* out, const void* ref, size_t n, int dtype,
+        const VerifyOptions* opt, VerifyResult* res);
+void verifyReport(const VerifyResult* res, const void* out, const void* ref,
+        int dtype, const VerifyOptions* opt);
+
+#endif
@@ -8,6 +8,7 @@
 // OpenCL includes
 #include <CL/cl.h>
 #include <time.h>
+#include "matrixio.h"
 
 #define BLOCKSIZE 32
 
@@ -65,45 +66,6 @@ char* readSource(char* kernelPath)
     return(source);
 }
 
-float* readDataFile(char fn[], int *mnum, int *nnum ){
-      /* first row of input file contains two ints: num rows and num cols */
-      /* rest of input file is data vals in row major order */
-      int status;
-      int size;
-      float *data;
-      int m,n,i;
-      FILE* fp;
-      fp=fopen(fn,"r");
-      if (!fp)
-      {
-          printf("Error opening file\n");
-      }
-      status = fseek(fp, 0, SEEK_END);
-      if (status != 0)
-      {
-          printf("Error seeking end of file\n");
-          exit(-1);
-      }
-      size = ftell(fp);
-      if (size<0)
-      {
-          printf("Error getting file position\n");
-          exit(-1);
-      }
-
-      rewind(fp);
-
-      fscanf(fp,"%d %d",&m, &n);
-      printf("Rows: %d, Columns:  %d\n", m, n);
-      data=malloc(sizeof(float)*m*n); //
-      for (i=0;i<m*n;i++)
-      fscanf(fp,"%f",&data[i]);
-      fclose(fp);
-      *mnum = m;  // store 'm' where the caller can see it
-      *nnum = n;  // store 'n' where the caller can see it
-      return(data);
-}
-
 // CPU-based matrix multiplication
 //
 void simpleMultiplyCPU( float *C, int widthA, int heightA, int widthB,
@@ -136,8 +98,13 @@ int main(int argc, char** argv) {
     int* Bcols = (int *) malloc(sizeof(int));
 ;
 
-    float* A = readDataFile(argv[1], Arows, Acols);  // Input array
-    float* B = readDataFile(argv[2], Brows, Bcols);  // Input array
+    MatrixFile mfA, mfB;
+    openMatrixFile(argv[1], MATRIX_FLOAT, &mfA);
+    openMatrixFile(argv[2], MATRIX_FLOAT, &mfB);
+    *Arows = mfA.rows; *Acols = mfA.cols;
+    *Brows = mfB.rows; *Bcols = mfB.cols;
+    float* A = (float*) mfA.data;  // Input array
+    float* B = (float*) mfB.data;  // Input array
     int CPU;
     int VERIFY;
     printf("%d\n", argc);
@@ -374,8 +341,8 @@ int main(int argc, char** argv) {
     clReleaseContext(context);
 
     // Free host resources
-    free(A);
-    free(B);
+    closeMatrixFile(&mfA);
+    closeMatrixFile(&mfB);
     free(C);
     free(platforms);
     free(devices);
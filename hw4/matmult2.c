@@ -10,6 +10,7 @@
 #include <time.h>
 
 #include <CL/cl.h>
+#include "matrixio.h"
 
 
 cl_device_id create_device()
@@ -93,36 +94,6 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename,
     return(program);
 }
 
-float* padDataMatrix(float* inData, int nrow, int ncol, int padcol, int padrow)
-{
-    float* paddedMatrix = (float*) malloc(sizeof(float)*(nrow + padrow)*(ncol + padcol));
-    int rw = 0;
-    int col = 0;
-    int idx = 0;
-    for (rw = 0; rw < nrow; rw ++)
-    {
-        for (col = 0; col < ncol; col ++)
-        {
-            paddedMatrix[idx] = inData[col + rw*ncol];
-            idx += 1;
-        }
-        for (col = 0; col < padcol; col ++)
-        {
-            paddedMatrix[idx] = 0.0;
-            idx += 1;
-        }
-    }
-    for (rw = 0; rw < padrow; rw ++)
-    {
-        for (col = 0; col < (ncol + padcol); col ++)
-        {
-            paddedMatrix[idx] = 0.0;
-            idx += 1;
-        }
-    }
-    return(paddedMatrix);
-}
-
 float* transposeDataMatrix(float* inData, int nrow, int ncol)
 {
     float* newvector = (float*) malloc(sizeof(float)*nrow*ncol);
@@ -180,85 +151,6 @@ void simpleMultiplyCPU_fp64( double *C, int widthA, int heightA, int widthB,
     }
 }
 
-float* readDataFile(char fn[], int *mnum, int *nnum ){
-      /* first row of input file contains two ints: num rows and num cols */
-      /* rest of input file is data vals in row major order */
-      int status;
-      int size;
-      float *data;
-      int m,n,i;
-      FILE* fp;
-      fp=fopen(fn,"r");
-      if (!fp)
-      {
-          printf("Error opening file\n");
-      }
-      status = fseek(fp, 0, SEEK_END);
-      if (status != 0)
-      {
-          printf("Error seeking end of file\n");
-          exit(-1);
-      }
-      size = ftell(fp);
-      if (size<0)
-      {
-          printf("Error getting file position\n");
-          exit(-1);
-      }
-
-      rewind(fp);
-
-      fscanf(fp,"%d %d",&m, &n);
-      printf("Rows: %d, Columns:  %d\n", m, n);
-      data=malloc(sizeof(float)*m*n); //
-      for (i=0;i<m*n;i++)
-      fscanf(fp,"%f",&data[i]);
-      fclose(fp);
-      *mnum = m;  // store 'm' where the caller can see it
-      *nnum = n;  // store 'n' where the caller can see it 
-      return(data);
-}
-
-double* readDataFileDouble(char fn[], int *mnum, int *nnum ){
-    
-      /* first row of input file contains two ints: num rows and num cols */
-      /* rest of input file is data vals in row major order */
-      int status;
-      int size;
-      double *data;
-      int m,n,i;
-      FILE* fp;
-      fp=fopen(fn,"r");
-      if (!fp)
-      {
-          printf("Error opening file\n");
-      }
-      status = fseek(fp, 0, SEEK_END);
-      if (status != 0)
-      {
-          printf("Error seeking end of file\n");
-          exit(-1);
-      }
-      size = ftell(fp);
-      if (size<0)
-      {
-          printf("Error getting file position\n");
-          exit(-1);
-      }
-
-      rewind(fp);
-
-      fscanf(fp,"%d %d",&m, &n);
-      printf("Rows: %d, Columns:  %d\n", m, n);
-      data=malloc(sizeof(double)*m*n); //
-      for (i=0;i<m*n;i++)
-      fscanf(fp,"%f",&data[i]);
-      fclose(fp);
-      *mnum = m;  // store 'm' where the caller can see it
-      *nnum = n;  // store 'n' where the caller can see it 
-      return(data);
-}
-
 void chk(cl_int status, const char* cmd)
 {
     if (status != CL_SUCCESS)
@@ -346,8 +238,13 @@ int main_fp()
     int* Brows = (int *) malloc(sizeof(int));
     int* Bcols = (int *) malloc(sizeof(int));
 
-    float* A = readDataFile("A.txt", Arows, Acols);  // Input array
-    float* B = readDataFile("B.txt", Brows, Bcols);  // Input array
+    MatrixFile mfA, mfB;
+    openMatrixFile("A.txt", MATRIX_FLOAT, &mfA);
+    openMatrixFile("B.txt", MATRIX_FLOAT, &mfB);
+    *Arows = mfA.rows; *Acols = mfA.cols;
+    *Brows = mfB.rows; *Bcols = mfB.cols;
+    float* A = (float*) mfA.data;  // Input array
+    float* B = (float*) mfB.data;  // Input array
 
     clock_t start;
 
@@ -379,26 +276,8 @@ int main_fp()
     globalworksize[0] = (*Bcols % ls == 0 ? *Bcols : (*Bcols/ls + 1)*ls);
     globalworksize[1] = (*Arows % ls == 0 ? *Arows : (*Arows/ls + 1)*ls);
 
-    int Apad_rows = globalworksize[1] - *Arows;
-    int Apad_cols = (*Acols % ls == 0 ? *Acols : (*Acols/ls + 1) * ls) - *Acols;
-
-    int Bpad_rows = Apad_cols;
-    int Bpad_cols = globalworksize[0] - *Bcols;
-
-    Bdatasize = sizeof(float)*((*Brows + Bpad_rows)*(*Bcols + Bpad_cols));
-    Adatasize = sizeof(float)*((*Arows + Apad_rows)*(*Acols + Apad_cols));
-    Cdatasize = sizeof(float)*(globalworksize[0]*globalworksize[1]);
-
-    C = (float*) realloc(C, Cdatasize);
-    status = (C == NULL);
-
-    chk(status, "Reallocation.");
-
- 
-    for (i = 0; i < Cdatasize/sizeof(float); i++)
-    {
-        C[i] = 0.0;
-    }
+    // Buffers stay at the exact matrix sizes: only the NDRange is rounded
+    // up, and the kernel bounds checks the ragged edge tiles.
 
     printf("Local work block size is: %d\n", ls);
     printf("Global work size is: %d by %d\n", globalworksize[0], globalworksize[1]);
@@ -511,8 +390,8 @@ int main_fp()
     clReleaseContext(context);
 
     // Free host resources
-    free(A);
-    free(B);
+    closeMatrixFile(&mfA);
+    closeMatrixFile(&mfB);
     free(C);
 
     return 0;
@@ -558,8 +437,13 @@ int main_fp64()
     int* Brows = (int *) malloc(sizeof(int));
     int* Bcols = (int *) malloc(sizeof(int));
 
-    double* A = readDataFileDouble("A.txt", Arows, Acols);  // Input array
-    double* B = readDataFileDouble("B.txt", Brows, Bcols);  // Input array
+    MatrixFile mfA, mfB;
+    openMatrixFile("A.txt", MATRIX_DOUBLE, &mfA);
+    openMatrixFile("B.txt", MATRIX_DOUBLE, &mfB);
+    *Arows = mfA.rows; *Acols = mfA.cols;
+    *Brows = mfB.rows; *Bcols = mfB.cols;
+    double* A = (double*) mfA.data;  // Input array
+    double* B = (double*) mfB.data;  // Input array
 
     clock_t start;
 
@@ -591,26 +475,8 @@ int main_fp64()
     globalworksize[0] = (*Bcols % ls == 0 ? *Bcols : (*Bcols/ls + 1)*ls);
     globalworksize[1] = (*Arows % ls == 0 ? *Arows : (*Arows/ls + 1)*ls);
 
-    int Apad_rows = globalworksize[1] - *Arows;
-    int Apad_cols = (*Acols % ls == 0 ? *Acols : (*Acols/ls + 1) * ls) - *Acols;
-
-    int Bpad_rows = Apad_cols;
-    int Bpad_cols = globalworksize[0] - *Bcols;
-
-    Bdatasize = sizeof(double)*((*Brows + Bpad_rows)*(*Bcols + Bpad_cols));
-    Adatasize = sizeof(double)*((*Arows + Apad_rows)*(*Acols + Apad_cols));
-    Cdatasize = sizeof(double)*(globalworksize[0]*globalworksize[1]);
-
-    C = (double*) realloc(C, Cdatasize);
-    status = (C == NULL);
-
-    chk(status, "Reallocation.");
-
- 
-    for (i = 0; i < Cdatasize/sizeof(double); i++)
-    {
-        C[i] = 0.0;
-    }
+    // Buffers stay at the exact matrix sizes: only the NDRange is rounded
+    // up, and the kernel bounds checks the ragged edge tiles.
 
     printf("Local work block size is: %d\n", ls);
     printf("Global work size is: %d by %d\n", globalworksize[0], globalworksize[1]);
@@ -724,8 +590,8 @@ int main_fp64()
     clReleaseContext(context);
 
     // Free host resources
-    free(A);
-    free(B);
+    closeMatrixFile(&mfA);
+    closeMatrixFile(&mfB);
     free(C);
 
     return 0;
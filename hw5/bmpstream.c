@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "bmpstream.h"
+
+static uint32_t get32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static off_t rowOffset(const BmpStream* bs, int row)
+{
+    if (bs->bottomUp)
+    {
+        row = bs->height - 1 - row;
+    }
+    return bs->dataOffset + (off_t) row*bs->rowBytes;
+}
+
+// Read the file and info headers; only uncompressed 8-bit images, the
+// kind readImage handles, are supported.
+void openBmpStream(const char* fn, BmpStream* bs)
+{
+    unsigned char header[54];
+    memset(bs, 0, sizeof(*bs));
+    bs->fp = fopen(fn, "rb");
+    if (bs->fp == NULL)
+    {
+        printf("Could not open image %s\n", fn);
+        exit(-1);
+    }
+    if (fread(header, 1, sizeof(header), bs->fp) != sizeof(header) ||
+            header[0] != 'B' || header[1] != 'M')
+    {
+        printf("%s is not a BMP file\n", fn);
+        exit(-1);
+    }
+    int32_t height = (int32_t) get32(header + 22);
+    int bits = header[28] | (header[29] << 8);
+    if (bits != 8 || get32(header + 30) != 0)
+    {
+        printf("%s: only uncompressed 8-bit BMP images can be streamed\n",
+                fn);
+        exit(-1);
+    }
+    bs->width = (int32_t) get32(header + 18);
+    bs->height = (height < 0 ? -height : height);
+    bs->bottomUp = (height > 0);
+    bs->rowBytes = (bs->width + 3) & ~3;
+    bs->dataOffset = get32(header + 10);
+}
+
+// Create fn with the headers and palette of the image like, for rows of
+// the same size
+void createBmpStream(const char* fn, const char* like, BmpStream* bs)
+{
+    BmpStream src;
+    openBmpStream(like, &src);
+    *bs = src;
+    bs->fp = fopen(fn, "wb+");
+    if (bs->fp == NULL)
+    {
+        printf("Could not create image %s\n", fn);
+        exit(-1);
+    }
+    size_t headerBytes = (size_t) src.dataOffset;
+    unsigned char* header = (unsigned char*) malloc(headerBytes);
+    fseeko(src.fp, 0, SEEK_SET);
+    if (fread(header, 1, headerBytes, src.fp) != headerBytes ||
+            fwrite(header, 1, headerBytes, bs->fp) != headerBytes)
+    {
+        printf("Error copying the BMP header to %s\n", fn);
+        exit(-1);
+    }
+    free(header);
+    closeBmpStream(&src);
+}
+
+// Image rows first .. first+count-1 as floats, top row first
+void readBmpRows(BmpStream* bs, int first, int count, float* rows)
+{
+    unsigned char* line = (unsigned char*) malloc(bs->rowBytes);
+    int r, c;
+    for (r = 0; r < count; r++)
+    {
+        if (fseeko(bs->fp, rowOffset(bs, first + r), SEEK_SET) != 0 ||
+                fread(line, 1, bs->rowBytes, bs->fp) != (size_t) bs->rowBytes)
+        {
+            printf("Error reading image row %d\n", first + r);
+            exit(-1);
+        }
+        for (c = 0; c < bs->width; c++)
+        {
+            rows[(size_t) r*bs->width + c] = line[c];
+        }
+    }
+    free(line);
+}
+
+// Store rows first .. first+count-1, clamped to 0 .. 255
+void writeBmpRows(BmpStream* bs, int first, int count, const float* rows)
+{
+    unsigned char* line = (unsigned char*) calloc(bs->rowBytes, 1);
+    int r, c;
+    for (r = 0; r < count; r++)
+    {
+        for (c = 0; c < bs->width; c++)
+        {
+            float v = rows[(size_t) r*bs->width + c];
+            line[c] = (v < 0.0f ? 0 : (v > 255.0f ? 255 : (unsigned char) v));
+        }
+        if (fseeko(bs->fp, rowOffset(bs, first + r), SEEK_SET) != 0 ||
+                fwrite(line, 1, bs->rowBytes, bs->fp) != (size_t) bs->rowBytes)
+        {
+            printf("Error writing image row %d\n", first + r);
+            exit(-1);
+        }
+    }
+    free(line);
+}
+
+void closeBmpStream(BmpStream* bs)
+{
+    if (bs->fp != NULL)
+    {
+        fclose(bs->fp);
+        bs->fp = NULL;
+    }
+}
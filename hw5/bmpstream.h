@@ -0,0 +1,26 @@
+#ifndef BMPSTREAM_H
+#define BMPSTREAM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// An 8-bit BMP opened for reading or writing a few rows at a time, so
+// images larger than memory can be processed in bands. Rows are numbered
+// top to bottom whatever the order they are stored in.
+typedef struct
+{
+    FILE* fp;
+    int width;
+    int height;
+    int rowBytes;       // stored row length, padded to 4 bytes
+    int bottomUp;       // rows stored bottom to top (positive height)
+    off_t dataOffset;
+} BmpStream;
+
+void openBmpStream(const char* fn, BmpStream* bs);
+void createBmpStream(const char* fn, const char* like, BmpStream* bs);
+void readBmpRows(BmpStream* bs, int first, int count, float* rows);
+void writeBmpRows(BmpStream* bs, int first, int count, const float* rows);
+void closeBmpStream(BmpStream* bs);
+
+#endif
@@ -1,17 +1,68 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <CL/cl.h> 
+#include "clruntime.h"
+#include "verify.h"
+#include "matrixio.h"
+#include "bmpstream.h"
 #include <time.h>
 #include "bmpfuncs.h"
 
 #define WGX 16
 #define WGY 16
 
-// Uncomment each of these (one at a time) to run with the corresponding 
-// optimization
-#define NON_OPTIMIZED
-//#define READ_ALIGNED
-//#define READ4 
+// Convolution strategies, selected per image at runtime (-strategy):
+// plain reads the image as is, aligned pads each row to a multiple of
+// WGX so work group reads start on aligned addresses, and read4 pads
+// the same way and caches the tile with one float4 load per work item.
+// fft multiplies overlap-save tiles in the frequency domain instead.
+#define CONV_AUTO 0
+#define CONV_PLAIN 1
+#define CONV_ALIGNED 2
+#define CONV_READ4 3
+#define CONV_FFT 4
+#define CONV_STRATEGIES 4
+
+// Narrow images stay unpadded when padding adds more than this fraction
+// of extra columns
+#define CONV_MAX_PAD_WASTE 0.25
+
+// Filters up to this width get kernels built for their exact width, with
+// fully unrolled filter loops; wider ones use the generic build
+#define CONV_MAX_UNROLL_WIDTH 31
+
+// FFT tiles are powers of two up to CONV_FFT_MAX_TILE, processed in
+// batches that keep each complex tile buffer within CONV_FFT_BATCH_BYTES
+#define CONV_FFT_MAX_TILE 1024
+#define CONV_FFT_BATCH_BYTES (64 << 20)
+
+// The filter width from which FFT beats direct convolution is measured
+// once per device, on a CONV_CALIBRATE_SIZE square image with filters of
+// CONV_CALIBRATE_MIN, +4, ... up to CONV_CALIBRATE_MAX, and stored in
+// CONV_TUNING_DB (CONV_DEFAULT_DB when that is unset) as
+//   device;crossover width
+#define CONV_CALIBRATE_SIZE 512
+#define CONV_CALIBRATE_MIN 3
+#define CONV_CALIBRATE_MAX 63
+#define CONV_CALIBRATE_TRIALS 3
+#define CONV_DEFAULT_DB "./convolution_tuning.db"
+
+// Output rows per band in streaming mode (-stream), unless -band says
+// otherwise
+#define CONV_BAND_ROWS 512
+
+// A filter is run as row and column passes when every tap is within
+// this fraction of the largest tap of a rank-1 factorization
+#define SEPARABLE_TOL 1e-5
+
+const char* strategyNames[CONV_STRATEGIES+1] =
+   {"auto", "plain", "aligned", "read4", "fft"};
+
+// Local memory of the device, which bounds the tiles the direct kernels
+// cache
+cl_ulong localMemBytes = 0;
 
 // This function takes a positive integer and rounds it up to
 // the nearest multiple of another provided integer
@@ -37,6 +88,32 @@ void stoptime (clock_t start, char msg[])
     printf("CPU time used for %s =  %.3lf \n", msg, cpu_time_used);
 }
 
+// Host reference for the kernels: every pixel at least the filter radius
+// away from the border gets the filtered value. The kernels leave the
+// border alone, so those pixels are taken from the device result.
+void convolutionCPU(float* out, const float* in, const float* device_out,
+      int rows, int cols, const float* filter, int filterWidth)
+{
+   int r, c, i, j;
+   int radius = filterWidth/2;
+   for(r = 0; r < rows; r++) {
+      for(c = 0; c < cols; c++) {
+         if(r < radius || r >= rows-radius || c < radius || c >= cols-radius) {
+            out[r*cols+c] = device_out[r*cols+c];
+            continue;
+         }
+         double sum = 0.0;
+         for(i = 0; i < filterWidth; i++) {
+            for(j = 0; j < filterWidth; j++) {
+               sum += in[(r-radius+i)*cols + (c-radius+j)] *
+                  filter[i*filterWidth+j];
+            }
+         }
+         out[r*cols+c] = sum;
+      }
+   }
+}
+
 // This function reads in a text file and stores it as a char pointer
 char* readSource(char* kernelPath) {
 
@@ -83,50 +160,472 @@ char* readSource(char* kernelPath) {
    return source;
 }
 
-int main(int argc, char** argv) {
+// The direct kernels cache a work group tile plus the filter halo in
+// local memory. read4 also fills it with exactly one float4 load per
+// work item, so the tile (rounded up to 4 columns) must not hold more
+// float4s than the group has work items. fft only needs a tile at least
+// as wide as the filter.
+int strategyFits(int strategy, int filterWidth) {
 
-   // Set up the data on the host	
-   clock_t start, start0;
-   start0 = clock();
-   start = clock();
-   // Rows and columns in the input image
-   int imageHeight;
-   int imageWidth;
+   int paddingPixels = (filterWidth/2) * 2;
+   if(strategy == CONV_FFT) {
+      return filterWidth <= CONV_FFT_MAX_TILE;
+   }
+   if(localMemBytes > 0 && (cl_ulong)(WGX+paddingPixels) *
+         (WGY+paddingPixels)*sizeof(float) > localMemBytes) {
+      return 0;
+   }
+   if(strategy != CONV_READ4) {
+      return 1;
+   }
+   return roundUp(WGX+paddingPixels, 4)/4 * (WGY+paddingPixels) <=
+      WGX*WGY;
+}
 
-   const char* inputFile = "input.bmp";
-   const char* outputFile = "output.bmp";
+// Pick a strategy for one image. Padded rows pay off unless the image
+// is so narrow that the padding is mostly waste; read4 then wins
+// whenever the filter halo fits its single load, and aligned rows only
+// help when the width is not a multiple of WGX already.
+int chooseStrategy(int imageWidth, int filterWidth) {
+
+   int paddedWidth = roundUp(imageWidth, WGX);
+   if(paddedWidth - imageWidth > CONV_MAX_PAD_WASTE*imageWidth) {
+      return CONV_PLAIN;
+   }
+   if(strategyFits(CONV_READ4, filterWidth)) {
+      return CONV_READ4;
+   }
+   if(paddedWidth != imageWidth) {
+      return CONV_ALIGNED;
+   }
+   return CONV_PLAIN;
+}
+
+// Factor a rank-1 filter as filter[i*filterWidth+j] == colFilter[i] *
+// rowFilter[j]. The row and column through the largest tap give the two
+// vectors; the filter is separable when every tap matches their product
+// to within SEPARABLE_TOL of that largest tap. Returns 0 otherwise.
+int separateFilter(const float* filter, int filterWidth,
+      float* colFilter, float* rowFilter) {
+
+   int i, j, pivot = 0;
+   int taps = filterWidth*filterWidth;
+   for(i = 1; i < taps; i++) {
+      if(fabs(filter[i]) > fabs(filter[pivot])) {
+         pivot = i;
+      }
+   }
+   double scale = filter[pivot];
+   if(scale == 0.0) {
+      return 0;
+   }
+   int pivotRow = pivot/filterWidth;
+   int pivotCol = pivot%filterWidth;
+   for(i = 0; i < filterWidth; i++) {
+      colFilter[i] = filter[i*filterWidth+pivotCol] / scale;
+      rowFilter[i] = filter[pivotRow*filterWidth+i];
+   }
+   for(i = 0; i < filterWidth; i++) {
+      for(j = 0; j < filterWidth; j++) {
+         double diff = filter[i*filterWidth+j] -
+            (double)colFilter[i]*rowFilter[j];
+         if(fabs(diff) > SEPARABLE_TOL*fabs(scale)) {
+            return 0;
+         }
+      }
+   }
+   return 1;
+}
 
+// Set the arguments every convolution kernel takes, run it over
+// globalSize in WGX x WGY work groups with a localHeight x localWidth
+// cached tile, and return the kernel time from timing_event in ns.
+cl_ulong enqueueConvolution(cl_command_queue queue, cl_kernel kernel,
+      cl_mem d_in, cl_mem d_out, cl_mem d_filter, int rows, int cols,
+      int filterWidth, int localHeight, int localWidth,
+      size_t* globalSize) {
 
+   cl_ulong time_start, time_end;
+   cl_event timing_event;
 
-   // Homegrown function to read a BMP from file
-   float* inputImage = readImage(inputFile, &imageWidth, 
-      &imageHeight);
+   // Size of a work group
+   size_t localSize[2] = {WGX, WGY};
 
-   // Size of the input and output images on the host
-   int dataSize = imageHeight*imageWidth*sizeof(float);
+   // Compute the size of local memory (needed for dynamic 
+   // allocation)
+   size_t localMemSize = (localWidth * localHeight * 
+      sizeof(float));
 
-   // Pad the number of columns 
-#ifdef NON_OPTIMIZED
+   // Set the kernel arguments
+   clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_in);
+   clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_out);
+   clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_filter);
+   clSetKernelArg(kernel, 3, sizeof(int), &rows);
+   clSetKernelArg(kernel, 4, sizeof(int), &cols); 
+   clSetKernelArg(kernel, 5, sizeof(int), &filterWidth);
+   clSetKernelArg(kernel, 6, localMemSize, NULL);
+   clSetKernelArg(kernel, 7, sizeof(int), &localHeight); 
+   clSetKernelArg(kernel, 8, sizeof(int), &localWidth);
+
+   // Execute the kernel
+   clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalSize, 
+      localSize, 0, NULL, &timing_event);
+
+   // Wait for kernel to complete
+   clFinish(queue);
+   clGetEventProfilingInfo(timing_event, CL_PROFILING_COMMAND_START,
+           sizeof(time_start), &time_start, NULL);
+   clGetEventProfilingInfo(timing_event, CL_PROFILING_COMMAND_END,
+           sizeof(time_end), &time_end, NULL);
+   clReleaseEvent(timing_event);
+
+   return time_end-time_start;
+}
+
+// Overlap-save tile size for a filter: the power of two, at least as
+// wide as the filter, with the least FFT work over all the tiles the
+// image needs.
+int fftTileSize(int filterWidth, int rows, int cols) {
+
+   int n, best = 0;
+   double bestCost = 0.0;
+   for(n = 4; n <= CONV_FFT_MAX_TILE; n *= 2) {
+      if(n < filterWidth) {
+         continue;
+      }
+      int validSize = n - filterWidth + 1;
+      double tiles = ceil((double)(rows-filterWidth+1)/validSize) *
+         ceil((double)(cols-filterWidth+1)/validSize);
+      double cost = tiles*n*n*log2(n);
+      if(best == 0 || cost < bestCost) {
+         best = n;
+         bestCost = cost;
+      }
+   }
+   return best;
+}
+
+// Run an FFT kernel over a 3D range, letting the runtime pick the work
+// group size, and return its time from timing_event in ns.
+cl_ulong enqueueFFT(cl_command_queue queue, cl_kernel kernel,
+      size_t* globalSize) {
+
+   cl_ulong time_start, time_end;
+   cl_event timing_event;
+   clEnqueueNDRangeKernel(queue, kernel, 3, NULL, globalSize, NULL,
+      0, NULL, &timing_event);
+   clWaitForEvents(1, &timing_event);
+   clGetEventProfilingInfo(timing_event, CL_PROFILING_COMMAND_START,
+           sizeof(time_start), &time_start, NULL);
+   clGetEventProfilingInfo(timing_event, CL_PROFILING_COMMAND_END,
+           sizeof(time_end), &time_end, NULL);
+   clReleaseEvent(timing_event);
+   return time_end-time_start;
+}
+
+// 2D FFT (dir -1) or unscaled inverse (dir 1) of numTiles n x n tiles:
+// radix-4 Stockham passes over the rows, plus a radix-2 pass when n is
+// not a power of 4, then the same over the columns. Passes ping-pong
+// between d_data and d_scratch; rows and columns take the same number
+// of passes, so the result always ends up back in d_data.
+void fftTiles(OclRuntime* rt, cl_program program, cl_mem d_data,
+      cl_mem d_scratch, int n, int numTiles, float dir,
+      cl_ulong* exec_time) {
+
+   cl_kernel radix2 = oclGetKernel(rt, program, "fft_radix2");
+   cl_kernel radix4 = oclGetKernel(rt, program, "fft_radix4");
+   int pass, p;
+   for(pass = 0; pass < 2; pass++) {
+      // Rows are contiguous lines, columns are strided ones
+      int elemStride = (pass == 0 ? 1 : n);
+      int lineStride = (pass == 0 ? n : 1);
+      for(p = 1; p < n; ) {
+         int radix = (p*4 <= n ? 4 : 2);
+         cl_kernel kernel = (radix == 4 ? radix4 : radix2);
+         size_t globalSize[3] = {n/radix, n, numTiles};
+         clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_data);
+         clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_scratch);
+         clSetKernelArg(kernel, 2, sizeof(int), &n);
+         clSetKernelArg(kernel, 3, sizeof(int), &p);
+         clSetKernelArg(kernel, 4, sizeof(int), &elemStride);
+         clSetKernelArg(kernel, 5, sizeof(int), &lineStride);
+         clSetKernelArg(kernel, 6, sizeof(float), &dir);
+         *exec_time += enqueueFFT(rt->queue, kernel, globalSize);
+
+         cl_mem swap = d_data;
+         d_data = d_scratch;
+         d_scratch = swap;
+         p *= radix;
+      }
+   }
+}
+
+// Load tiles first .. first+count-1 of a rows x cols image (or the filter
+// as a single zero-padded tile) into d_tiles
+cl_ulong loadTiles(OclRuntime* rt, cl_program program, cl_mem d_image,
+      cl_mem d_tiles, int rows, int cols, int tileSize, int validSize,
+      int tilesX, int first, int count) {
+
+   cl_kernel kernel = oclGetKernel(rt, program, "fft_load_tiles");
+   size_t globalSize[3] = {tileSize, tileSize, count};
+   clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_image);
+   clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_tiles);
+   clSetKernelArg(kernel, 2, sizeof(int), &rows);
+   clSetKernelArg(kernel, 3, sizeof(int), &cols);
+   clSetKernelArg(kernel, 4, sizeof(int), &tileSize);
+   clSetKernelArg(kernel, 5, sizeof(int), &validSize);
+   clSetKernelArg(kernel, 6, sizeof(int), &tilesX);
+   clSetKernelArg(kernel, 7, sizeof(int), &first);
+   return enqueueFFT(rt->queue, kernel, globalSize);
+}
+
+// Convolve the image through FFTs of overlap-save tiles: each batch of
+// tiles is transformed, multiplied by the filter's spectrum, transformed
+// back and its valid part stored into the output image. The input is
+// written unpadded and the interior pixels are read back into
+// outputImage. Returns the summed kernel time in seconds.
+double runFFTConvolution(OclRuntime* rt, cl_program program,
+      float* outputImage, float* inputImage, int imageHeight,
+      int imageWidth, cl_mem d_filter, int filterWidth) {
+
+   cl_context context = rt->context;
+   cl_command_queue queue = rt->queue;
+   cl_ulong exec_time = 0;
+   int filterRadius = filterWidth/2;
+   int paddingPixels = filterRadius * 2;
+
+   int tileSize = fftTileSize(filterWidth, imageHeight, imageWidth);
+   int validSize = tileSize - filterWidth + 1;
+   int tileArea = tileSize*tileSize;
+   int tilesX = (imageWidth-paddingPixels + validSize-1)/validSize;
+   int tilesY = (imageHeight-paddingPixels + validSize-1)/validSize;
+   int numTiles = tilesX*tilesY;
+   int batch = CONV_FFT_BATCH_BYTES/(tileArea*2*sizeof(float));
+   if(batch < 1) {
+      batch = 1;
+   }
+   if(batch > numTiles) {
+      batch = numTiles;
+   }
+   size_t dataSize = (size_t)imageHeight*imageWidth*sizeof(float);
+   size_t tileBytes = (size_t)tileArea*2*sizeof(float);
+   // The inverse transform is unscaled
+   float scale = 1.0f/tileArea;
+
+   cl_mem d_inputImage = clCreateBuffer(context, CL_MEM_READ_ONLY,
+      dataSize, NULL, NULL);
+   cl_mem d_outputImage = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+      dataSize, NULL, NULL);
+   cl_mem d_tiles = clCreateBuffer(context, CL_MEM_READ_WRITE,
+      batch*tileBytes, NULL, NULL);
+   cl_mem d_scratch = clCreateBuffer(context, CL_MEM_READ_WRITE,
+      batch*tileBytes, NULL, NULL);
+   cl_mem d_spectrum = clCreateBuffer(context, CL_MEM_READ_WRITE,
+      tileBytes, NULL, NULL);
+   clEnqueueWriteBuffer(queue, d_inputImage, CL_TRUE, 0, dataSize,
+      inputImage, 0, NULL, NULL);
+
+   // Spectrum of the filter zero-padded to a tile
+   exec_time += loadTiles(rt, program, d_filter, d_spectrum, filterWidth,
+      filterWidth, tileSize, validSize, 1, 0, 1);
+   fftTiles(rt, program, d_spectrum, d_scratch, tileSize, 1, -1,
+      &exec_time);
+
+   cl_kernel multiply = oclGetKernel(rt, program, "fft_multiply");
+   cl_kernel store = oclGetKernel(rt, program, "fft_store_tiles");
+   int first;
+   for(first = 0; first < numTiles; first += batch) {
+      int count = (numTiles-first < batch ? numTiles-first : batch);
+      exec_time += loadTiles(rt, program, d_inputImage, d_tiles,
+         imageHeight, imageWidth, tileSize, validSize, tilesX, first,
+         count);
+      fftTiles(rt, program, d_tiles, d_scratch, tileSize, count, -1,
+         &exec_time);
+
+      size_t multiplySize[3] = {tileArea, count, 1};
+      clSetKernelArg(multiply, 0, sizeof(cl_mem), &d_tiles);
+      clSetKernelArg(multiply, 1, sizeof(cl_mem), &d_spectrum);
+      clSetKernelArg(multiply, 2, sizeof(int), &tileArea);
+      exec_time += enqueueFFT(queue, multiply, multiplySize);
+
+      fftTiles(rt, program, d_tiles, d_scratch, tileSize, count, 1,
+         &exec_time);
+
+      size_t storeSize[3] = {validSize, validSize, count};
+      clSetKernelArg(store, 0, sizeof(cl_mem), &d_tiles);
+      clSetKernelArg(store, 1, sizeof(cl_mem), &d_outputImage);
+      clSetKernelArg(store, 2, sizeof(int), &imageHeight);
+      clSetKernelArg(store, 3, sizeof(int), &imageWidth);
+      clSetKernelArg(store, 4, sizeof(int), &tileSize);
+      clSetKernelArg(store, 5, sizeof(int), &validSize);
+      clSetKernelArg(store, 6, sizeof(int), &tilesX);
+      clSetKernelArg(store, 7, sizeof(int), &first);
+      clSetKernelArg(store, 8, sizeof(int), &filterRadius);
+      clSetKernelArg(store, 9, sizeof(float), &scale);
+      exec_time += enqueueFFT(queue, store, storeSize);
+   }
+
+   // Read back the interior, the border pixels are never written
+   size_t buffer_origin[3] = {filterRadius*sizeof(float), filterRadius, 0};
+   size_t host_origin[3] = {filterRadius*sizeof(float), filterRadius, 0};
+   size_t region[3] = {(imageWidth-paddingPixels)*sizeof(float),
+      imageHeight-paddingPixels, 1};
+   clEnqueueReadBufferRect(queue, d_outputImage, CL_TRUE, 
+      buffer_origin, host_origin, region, 
+      imageWidth*sizeof(float), 0, imageWidth*sizeof(float), 0, 
+      outputImage, 0, NULL, NULL);
+
+   clReleaseMemObject(d_inputImage);
+   clReleaseMemObject(d_outputImage);
+   clReleaseMemObject(d_tiles);
+   clReleaseMemObject(d_scratch);
+   clReleaseMemObject(d_spectrum);
+
+   return (double)exec_time/1000000000;
+}
+
+// Convolve the image on the device with the given strategy. The input
+// is written with rows padded to deviceWidth for the aligned strategies,
+// and the interior pixels are read back into outputImage (all of the
+// device image for plain). With a column filter the filter is separable:
+// d_filter holds its row vector and the row and column passes replace
+// the full kernel, read4 then falling back to the scalar loads. fft
+// always takes the full filter. Returns the kernel time from
+// timing_event in seconds.
+double runConvolution(OclRuntime* rt, cl_program program, int strategy,
+      float* outputImage, float* inputImage, int imageHeight,
+      int imageWidth, cl_mem d_filter, cl_mem d_colFilter,
+      int filterWidth) {
+
+   cl_context context = rt->context;
+   cl_command_queue queue = rt->queue;
+   cl_ulong exec_time;
+   int filterRadius = filterWidth/2;
+   int paddingPixels = filterRadius * 2;
+
+   if(strategy == CONV_FFT) {
+      return runFFTConvolution(rt, program, outputImage, inputImage,
+         imageHeight, imageWidth, d_filter, filterWidth);
+   }
+
+   // Pad the number of columns
    int deviceWidth = imageWidth;
-#else  // READ_ALIGNED || READ4
-   int deviceWidth = roundUp(imageWidth, WGX);
-#endif
+   if(strategy != CONV_PLAIN) {
+      deviceWidth = roundUp(imageWidth, WGX);
+   }
    int deviceHeight = imageHeight;
    // Size of the input and output images on the device
-   int deviceDataSize = imageHeight*deviceWidth*sizeof(float);
+   size_t deviceDataSize = (size_t)deviceHeight*deviceWidth*sizeof(float);
 
-   // Output image on the host
-   float* outputImage = NULL;
-   outputImage = (float*)malloc(dataSize);
-   int i, j;
-   for(i = 0; i < imageHeight; i++) {
-       for(j = 0; j < imageWidth; j++) {
-           outputImage[i*imageWidth+j] = 0;
-       }
+   // Create memory buffers
+   cl_mem d_inputImage;
+   cl_mem d_outputImage;
+   d_inputImage = clCreateBuffer(context, CL_MEM_READ_ONLY, 
+       deviceDataSize, NULL, NULL);
+   d_outputImage = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
+       deviceDataSize, NULL, NULL);
+
+   // Write input data to the device
+   size_t buffer_origin[3] = {0,0,0};
+   size_t host_origin[3] = {0,0,0};
+   size_t region[3] = {imageWidth*sizeof(float), imageHeight, 1};
+   if(strategy == CONV_PLAIN) {
+      clEnqueueWriteBuffer(queue, d_inputImage, CL_TRUE, 0,
+         deviceDataSize, inputImage, 0, NULL, NULL);
+   }
+   else {
+      // Only the image columns are copied; the padding columns feed
+      // outputs that are never read back
+      clEnqueueWriteBufferRect(queue, d_inputImage, CL_TRUE, 
+         buffer_origin, host_origin, region, 
+         deviceWidth*sizeof(float), 0, imageWidth*sizeof(float), 0,
+         inputImage, 0, NULL, NULL);
+   }
+
+   // When computing the total number of work items, the 
+   // padding work items do not need to be considered
+   size_t globalSize[2] = {roundUp(imageWidth-paddingPixels, WGX),
+      roundUp(imageHeight-paddingPixels, WGY)};
+
+   if(d_colFilter == NULL) {
+      // The amount of local data that is cached is the size of the
+      // work groups plus the padding pixels
+      int localWidth = WGX + paddingPixels;
+      int localHeight = WGY + paddingPixels;
+      cl_kernel kernel;
+      if(strategy == CONV_READ4) {
+         // Round the local width up to 4 for the read4 kernel
+         localWidth = roundUp(localWidth, 4);
+         kernel = oclGetKernel(rt, program, "convolution_read4");
+      }
+      else {
+         // Only the host-side code differs for the aligned reads
+         kernel = oclGetKernel(rt, program, "convolution");
+      }
+      exec_time = enqueueConvolution(queue, kernel, d_inputImage,
+         d_outputImage, d_filter, deviceHeight, deviceWidth,
+         filterWidth, localHeight, localWidth, globalSize);
    }
+   else {
+      // The row pass covers the border rows as well, and each pass
+      // only caches the halo along its own direction
+      cl_mem d_rowsImage = clCreateBuffer(context, CL_MEM_READ_WRITE,
+         deviceDataSize, NULL, NULL);
+      size_t rowsGlobalSize[2] = {globalSize[0],
+         roundUp(imageHeight, WGY)};
+      exec_time = enqueueConvolution(queue,
+         oclGetKernel(rt, program, "convolution_rows"), d_inputImage,
+         d_rowsImage, d_filter, deviceHeight, deviceWidth, filterWidth,
+         WGY, WGX + paddingPixels, rowsGlobalSize);
+      exec_time += enqueueConvolution(queue,
+         oclGetKernel(rt, program, "convolution_cols"), d_rowsImage,
+         d_outputImage, d_colFilter, deviceHeight, deviceWidth,
+         filterWidth, WGY + paddingPixels, WGX, globalSize);
+      clReleaseMemObject(d_rowsImage);
+   }
+
+   // Read back the output image
+   if(strategy == CONV_PLAIN) {
+      clEnqueueReadBuffer(queue, d_outputImage, CL_TRUE, 0, 
+         deviceDataSize, outputImage, 0, NULL, NULL);
+   }
+   else {
+      // Begin reading output from (radius,radius) on the device 
+      buffer_origin[0] = filterRadius*sizeof(float);
+      buffer_origin[1] = filterRadius;
+      buffer_origin[2] = 0;
+
+      // Read data into (radius,radius) on the host
+      host_origin[0] = filterRadius*sizeof(float);
+      host_origin[1] = filterRadius;
+      host_origin[2] = 0;
+
+      // Region is image size minus padding pixels
+      region[0] = (imageWidth-paddingPixels)*sizeof(float);
+      region[1] = (imageHeight-paddingPixels);
+      region[2] = 1;
+
+      // Perform the read
+      clEnqueueReadBufferRect(queue, d_outputImage, CL_TRUE, 
+         buffer_origin, host_origin, region, 
+         deviceWidth*sizeof(float), 0, imageWidth*sizeof(float), 0, 
+         outputImage, 0, NULL, NULL);
+   }
+
+   clReleaseMemObject(d_inputImage);
+   clReleaseMemObject(d_outputImage);
+
+   return (double)exec_time/1000000000;
+}
+
+// Built-in filters (-filter): the 45 degree motion blur, which is not
+// separable, and the common separable ones. Gaussian and box take any
+// odd *filterWidth (7 when it is 0); motion is 7x7 and sobel 3x3.
+// Returns a filterWidth x filterWidth array.
+float* makeFilter(const char* name, int* filterWidth) {
 
    // 45 degree motion blur
-   float filter[49] = 
+   static const float motion[49] = 
       {0,      0,      0,      0,      0, 0.0145,      0,
        0,      0,      0,      0, 0.0376, 0.1283, 0.0145,
        0,      0,      0, 0.0376, 0.1283, 0.0376,      0,
@@ -134,191 +633,660 @@ int main(int argc, char** argv) {
        0, 0.0376, 0.1283, 0.0376,      0,      0,      0,
   0.0145, 0.1283, 0.0376,      0,      0,      0,      0,
        0, 0.0145,      0,      0,      0,      0,      0};
- 
-   int filterWidth = 7;
-   int paddingPixels = (int)(filterWidth/2) * 2; 
+   // Horizontal gradient, smoothing down the columns
+   static const float sobelRow[3] = {-1, 0, 1};
+   static const float sobelCol[3] = {1, 2, 1};
+
+   int i, j, width = 7;
+   if(strcmp(name, "sobel") == 0) {
+      width = 3;
+   }
+   if(*filterWidth > 0 && *filterWidth != width) {
+      if(strcmp(name, "gaussian") != 0 && strcmp(name, "box") != 0) {
+         printf("Filter %s is %dx%d only\n", name, width, width);
+         exit(1);
+      }
+      width = *filterWidth;
+   }
+   float* filter = (float*)malloc(width*width*sizeof(float));
+   if(strcmp(name, "motion") == 0) {
+      memcpy(filter, motion, sizeof(motion));
+   }
+   else if(strcmp(name, "gaussian") == 0) {
+      // sigma of a sixth of the width, normalized to sum to 1
+      double sigma = width/6.0, total = 0.0;
+      double* g = (double*)malloc(width*sizeof(double));
+      for(i = 0; i < width; i++) {
+         double x = i - width/2;
+         g[i] = exp(-x*x/(2*sigma*sigma));
+         total += g[i];
+      }
+      for(i = 0; i < width; i++) {
+         for(j = 0; j < width; j++) {
+            filter[i*width+j] = g[i]*g[j]/(total*total);
+         }
+      }
+      free(g);
+   }
+   else if(strcmp(name, "box") == 0) {
+      for(i = 0; i < width*width; i++) {
+         filter[i] = 1.0f/(width*width);
+      }
+   }
+   else if(strcmp(name, "sobel") == 0) {
+      for(i = 0; i < width; i++) {
+         for(j = 0; j < width; j++) {
+            filter[i*width+j] = sobelCol[i]*sobelRow[j];
+         }
+      }
+   }
+   else {
+      printf("Unknown filter %s (motion, gaussian, box or sobel)\n", name);
+      exit(1);
+   }
+   *filterWidth = width;
+   return filter;
+}
+
+// Run one configuration -trials times after a warm-up run and print its
+// min and mean kernel time, whether the output checks out and whether it
+// is the one auto would pick.
+void benchConvolution(OclRuntime* rt, cl_program program, int strategy,
+      const char* label, float* benchImage, float* refImage,
+      float* inputImage, int imageHeight, int imageWidth,
+      const float* filter, cl_mem d_filter, cl_mem d_colFilter,
+      int filterWidth, int trials, const VerifyOptions* vopts,
+      int isAuto) {
+
+   size_t dataSize = (size_t)imageHeight*imageWidth*sizeof(float);
+   double best = 0.0, total = 0.0;
+   int t;
+   VerifyResult check;
+
+   // One untimed run to warm up
+   memset(benchImage, 0, dataSize);
+   runConvolution(rt, program, strategy, benchImage, inputImage,
+      imageHeight, imageWidth, d_filter, d_colFilter, filterWidth);
+   for(t = 0; t < trials; t++) {
+      double sec = runConvolution(rt, program, strategy, benchImage,
+         inputImage, imageHeight, imageWidth, d_filter, d_colFilter,
+         filterWidth);
+      if(t == 0 || sec < best) {
+         best = sec;
+      }
+      total += sec;
+   }
+   convolutionCPU(refImage, inputImage, benchImage, imageHeight,
+      imageWidth, filter, filterWidth);
+   int result = verifyArrays(benchImage, refImage,
+      (size_t)imageHeight*imageWidth, VERIFY_FLOAT, vopts, &check);
+   printf("%-12s %8d %14.4f %14.4f  %s%s\n", label, trials, best*1000,
+      total/trials*1000, result ? "correct" : "incorrect",
+      isAuto ? " (auto)" : "");
+}
+
+// Build the kernels specialized for the filter width, unless it is very
+// wide. Builds are cached by source hash and options, so each width is
+// compiled once.
+cl_program buildConvolution(OclRuntime* rt, const char* source,
+      int filterWidth) {
+
+   char options[64] = "";
+   if(filterWidth <= CONV_MAX_UNROLL_WIDTH) {
+      sprintf(options, "-DFILTER_WIDTH=%d", filterWidth);
+   }
+   return oclGetProgram(rt, source, strlen(source), options);
+}
+
+const char* convTuningDb() {
+
+   const char* fn = getenv("CONV_TUNING_DB");
+   return fn != NULL ? fn : CONV_DEFAULT_DB;
+}
+
+// The stored crossover width for a device, 0 when it was never measured
+int lookupCrossover(const char* device) {
+
+   char line[512];
+   int width = 0;
+   FILE* fp = fopen(convTuningDb(), "r");
+   if(fp == NULL) {
+      return 0;
+   }
+   while(fgets(line, sizeof(line), fp) != NULL) {
+      char* sep = strrchr(line, ';');
+      if(sep != NULL && sep-line == (long)strlen(device) &&
+            strncmp(line, device, sep-line) == 0) {
+         width = atoi(sep+1);
+      }
+   }
+   fclose(fp);
+   return width;
+}
+
+// Rewrite the database with this device's crossover replacing any
+// earlier one
+void storeCrossover(const char* device, int width) {
+
+   char line[512], tmpname[1024];
+   const char* fn = convTuningDb();
+   FILE* in = fopen(fn, "r");
+   FILE* out;
+
+   snprintf(tmpname, sizeof(tmpname), "%s.tmp", fn);
+   out = fopen(tmpname, "w");
+   if(out == NULL) {
+      printf("Couldn't write tuning database %s\n", tmpname);
+      if(in != NULL) fclose(in);
+      return;
+   }
+   if(in != NULL) {
+      while(fgets(line, sizeof(line), in) != NULL) {
+         char* sep = strrchr(line, ';');
+         if(sep != NULL && sep-line == (long)strlen(device) &&
+               strncmp(line, device, sep-line) == 0) {
+            continue;
+         }
+         fputs(line, out);
+      }
+      fclose(in);
+   }
+   fprintf(out, "%s;%d\n", device, width);
+   fclose(out);
+   rename(tmpname, fn);
+}
+
+// Best of CONV_CALIBRATE_TRIALS runs after a warm-up, in seconds
+double bestTime(OclRuntime* rt, cl_program program, int strategy,
+      float* outputImage, float* inputImage, int size, cl_mem d_filter,
+      int filterWidth) {
+
+   double best = 0.0;
+   int t;
+   runConvolution(rt, program, strategy, outputImage, inputImage, size,
+      size, d_filter, NULL, filterWidth);
+   for(t = 0; t < CONV_CALIBRATE_TRIALS; t++) {
+      double sec = runConvolution(rt, program, strategy, outputImage,
+         inputImage, size, size, d_filter, NULL, filterWidth);
+      if(t == 0 || sec < best) {
+         best = sec;
+      }
+   }
+   return best;
+}
+
+// Time the full 2D direct kernels against FFT convolution for growing
+// filter widths and return the first width at which FFT is faster, or
+// CONV_CALIBRATE_MAX+2 when it never is.
+int measureCrossover(OclRuntime* rt, const char* source) {
+
+   int size = CONV_CALIBRATE_SIZE;
+   int i, width, crossover = CONV_CALIBRATE_MAX + 2;
+   size_t dataSize = (size_t)size*size*sizeof(float);
+   float* image = (float*)malloc(dataSize);
+   float* out = (float*)malloc(dataSize);
+   for(i = 0; i < size*size; i++) {
+      image[i] = (i*37) % 255;
+   }
+
+   printf("Measuring the direct/FFT crossover on a %dx%d image\n",
+      size, size);
+   for(width = CONV_CALIBRATE_MIN; width <= CONV_CALIBRATE_MAX;
+         width += 4) {
+      int direct = chooseStrategy(size, width);
+      if(!strategyFits(direct, width)) {
+         direct = CONV_PLAIN;
+      }
+      if(!strategyFits(direct, width)) {
+         crossover = width;
+         break;
+      }
+      int filterWidth = width;
+      float* filter = makeFilter("box", &filterWidth);
+      cl_mem d_filter = clCreateBuffer(rt->context, CL_MEM_READ_ONLY,
+         width*width*sizeof(float), NULL, NULL);
+      clEnqueueWriteBuffer(rt->queue, d_filter, CL_TRUE, 0,
+         width*width*sizeof(float), filter, 0, NULL, NULL);
+      cl_program program = buildConvolution(rt, source, width);
+
+      double directTime = bestTime(rt, program, direct, out, image, size,
+         d_filter, width);
+      double fftTime = bestTime(rt, program, CONV_FFT, out, image, size,
+         d_filter, width);
+      printf("  %2dx%-2d filter: %s %.3f ms, fft %.3f ms\n", width, width,
+         strategyNames[direct], directTime*1000, fftTime*1000);
+
+      clReleaseMemObject(d_filter);
+      free(filter);
+      if(fftTime < directTime) {
+         crossover = width;
+         break;
+      }
+   }
+   free(image);
+   free(out);
+   return crossover;
+}
+
+// Convolve an image too large to load whole, band by band. Each band of
+// bandRows output rows is read with the filterRadius halo rows above and
+// below it, convolved with the chosen strategy and written out before the
+// next band is read, so host and device memory depend on the band size and
+// not on the image height. With VERIFY_RESULTS set each band is also
+// checked against the host convolution. Border pixels, which the kernels
+// leave alone, are written as zero.
+void streamConvolution(OclRuntime* rt, cl_program program, int strategy,
+      const char* inputFile, const char* outputFile, const float* filter,
+      cl_mem d_filter, cl_mem d_colFilter, int filterWidth, int bandRows,
+      const VerifyOptions* vopts) {
+
+   BmpStream in, out;
+   openBmpStream(inputFile, &in);
+   createBmpStream(outputFile, inputFile, &out);
+   int rows = in.height;
+   int cols = in.width;
+   int filterRadius = filterWidth/2;
+   size_t rowSize = (size_t)cols*sizeof(float);
+   float* inBand = (float*)malloc((bandRows + 2*filterRadius)*rowSize);
+   float* outBand = (float*)malloc((bandRows + 2*filterRadius)*rowSize);
+   int verify = verifyEnabled();
+   float* refBand = (verify ?
+      (float*)malloc((bandRows + 2*filterRadius)*rowSize) : NULL);
+   double kernelTime = 0.0;
+   size_t checked = 0, failed = 0;
+   int bands = 0, first, r, c;
+
+   for(first = 0; first < rows; first += bandRows) {
+      int last = (first + bandRows < rows ? first + bandRows : rows);
+      // Input rows with the halo, clipped to the image
+      int inFirst = (first - filterRadius > 0 ? first - filterRadius : 0);
+      int inLast = (last + filterRadius < rows ? last + filterRadius : rows);
+      int inRows = inLast - inFirst;
+      // Output rows at least filterRadius away from the top and bottom
+      int validFirst = (first > filterRadius ? first : filterRadius);
+      int validLast = (last < rows-filterRadius ? last : rows-filterRadius);
+
+      memset(outBand, 0, inRows*rowSize);
+      if(validFirst < validLast) {
+         readBmpRows(&in, inFirst, inRows, inBand);
+         kernelTime += runConvolution(rt, program, strategy, outBand,
+            inBand, inRows, cols, d_filter, d_colFilter, filterWidth);
+
+         if(verify) {
+            convolutionCPU(refBand, inBand, outBand, inRows, cols, filter,
+               filterWidth);
+            VerifyResult check;
+            float* o = outBand + (size_t)(validFirst-inFirst)*cols;
+            float* ref = refBand + (size_t)(validFirst-inFirst)*cols;
+            if(!verifyArrays(o, ref, (size_t)(validLast-validFirst)*cols,
+                  VERIFY_FLOAT, vopts, &check)) {
+               printf("Band at rows %d-%d is incorrect\n", first, last-1);
+               verifyReport(&check, o, ref, VERIFY_FLOAT, vopts);
+            }
+            checked += check.checked;
+            failed += check.failed;
+         }
+
+         // Plain reads back the whole band, border columns included
+         for(r = 0; r < inRows; r++) {
+            for(c = 0; c < cols; c++) {
+               if(c < filterRadius || c >= cols-filterRadius ||
+                     inFirst+r < validFirst || inFirst+r >= validLast) {
+                  outBand[(size_t)r*cols + c] = 0;
+               }
+            }
+         }
+      }
+      writeBmpRows(&out, first, last-first,
+         outBand + (size_t)(first-inFirst)*cols);
+      bands++;
+   }
+
+   printf("Streamed %d bands of %d rows (%.1f MB per band buffer)\n",
+      bands, bandRows, (bandRows + 2*filterRadius)*rowSize/1048576.0);
+   printf("Profile execution time = %.3lf sec.\n", kernelTime);
+   if(verify) {
+      printf("Checked %zu elements: %zu outside tolerance\n", checked, failed);
+      printf("Output is %s\n", failed == 0 ? "correct" : "incorrect");
+   }
+
+   free(inBand);
+   free(outBand);
+   free(refBand);
+   closeBmpStream(&in);
+   closeBmpStream(&out);
+}
+
+int main(int argc, char** argv) {
+
+   // Set up the data on the host	
+   clock_t start, start0;
+   // Result check tolerances, see verify.h
+   VerifyOptions vopts;
+   verifyDefaults(&vopts);
+   const char* inputFile = "input.bmp";
+   const char* outputFile = "output.bmp";
+   int strategy = CONV_AUTO;
+   int bench = 0;
+   int trials = 5;
+   const char* filterName = "motion";
+   char* filterFile = NULL;
+   int filterWidth = 0;
+   int trySeparable = 1;
+   int tryFFT = 1;
+   int calibrate = 0;
+   int stream = 0;
+   int bandRows = CONV_BAND_ROWS;
+   int arg, s;
+   for(arg = 1; arg < argc; arg++) {
+      if(verifyOption(argc, argv, &arg, &vopts)) {
+         continue;
+      }
+      if(strcmp(argv[arg], "-bench") == 0) {
+         bench = 1;
+      }
+      else if(strcmp(argv[arg], "-nosep") == 0) {
+         trySeparable = 0;
+      }
+      else if(strcmp(argv[arg], "-nofft") == 0) {
+         tryFFT = 0;
+      }
+      else if(strcmp(argv[arg], "-calibrate") == 0) {
+         calibrate = 1;
+      }
+      else if(strcmp(argv[arg], "-stream") == 0) {
+         stream = 1;
+      }
+      else if(strcmp(argv[arg], "-band") == 0 && arg+1 < argc) {
+         bandRows = atoi(argv[++arg]);
+         if(bandRows < 1) {
+            bandRows = 1;
+         }
+      }
+      else if(strcmp(argv[arg], "-filter") == 0 && arg+1 < argc) {
+         filterName = argv[++arg];
+      }
+      else if(strcmp(argv[arg], "-width") == 0 && arg+1 < argc) {
+         filterWidth = atoi(argv[++arg]);
+      }
+      else if(strcmp(argv[arg], "-filterfile") == 0 && arg+1 < argc) {
+         filterFile = argv[++arg];
+      }
+      else if(strcmp(argv[arg], "-strategy") == 0 && arg+1 < argc) {
+         arg++;
+         for(s = 0; s <= CONV_STRATEGIES; s++) {
+            if(strcmp(argv[arg], strategyNames[s]) == 0) {
+               break;
+            }
+         }
+         if(s > CONV_STRATEGIES) {
+            printf("Unknown strategy %s (auto, plain, aligned, read4 or "
+               "fft)\n",
+               argv[arg]);
+            exit(1);
+         }
+         strategy = s;
+      }
+      else if(strcmp(argv[arg], "-trials") == 0 && arg+1 < argc) {
+         trials = atoi(argv[++arg]);
+         if(trials < 1) {
+            trials = 1;
+         }
+      }
+      else if(strcmp(argv[arg], "-input") == 0 && arg+1 < argc) {
+         inputFile = argv[++arg];
+      }
+      else if(strcmp(argv[arg], "-output") == 0 && arg+1 < argc) {
+         outputFile = argv[++arg];
+      }
+      else {
+         printf("Unknown option %s\n", argv[arg]);
+         exit(1);
+      }
+   }
+   if(stream && bench) {
+      printf("-bench needs the whole image, it cannot be streamed\n");
+      exit(1);
+   }
+   start0 = clock();
+   start = clock();
+   // Rows and columns in the input image
+   int imageHeight;
+   int imageWidth;
+
+   float* inputImage = NULL;
+   float* outputImage = NULL;
+   int dataSize = 0;
+   if(stream) {
+      // Only the size is needed now, the rows are read band by band
+      BmpStream in;
+      openBmpStream(inputFile, &in);
+      imageWidth = in.width;
+      imageHeight = in.height;
+      closeBmpStream(&in);
+   }
+   else {
+      // Homegrown function to read a BMP from file
+      inputImage = readImage(inputFile, &imageWidth, 
+         &imageHeight);
+
+      // Size of the input and output images on the host
+      dataSize = imageHeight*imageWidth*sizeof(float);
+
+      // Output image on the host
+      outputImage = (float*)malloc(dataSize);
+      int i, j;
+      for(i = 0; i < imageHeight; i++) {
+          for(j = 0; j < imageWidth; j++) {
+              outputImage[i*imageWidth+j] = 0;
+          }
+      }
+   }
+
+   // A filter file holds a square matrix in the text format of
+   // readDataFile
+   float* filter;
+   if(filterFile != NULL) {
+      int filterRows, filterCols;
+      filter = readDataFile(filterFile, &filterRows, &filterCols);
+      if(filterRows != filterCols) {
+         printf("Filter in %s is not square (%dx%d)\n", filterFile,
+            filterRows, filterCols);
+         exit(1);
+      }
+      filterName = filterFile;
+      filterWidth = filterRows;
+   }
+   else {
+      filter = makeFilter(filterName, &filterWidth);
+   }
+   if(filterWidth < 1 || filterWidth % 2 == 0) {
+      printf("Filter width must be odd (got %d)\n", filterWidth);
+      exit(1);
+   }
+   if(filterWidth > imageWidth || filterWidth > imageHeight) {
+      printf("A %dx%d filter does not fit a %dx%d image\n", filterWidth,
+         filterWidth, imageWidth, imageHeight);
+      exit(1);
+   }
    stoptime(start, "set up input, output.");
    start = clock();
    // Set up the OpenCL environment
 
-   // Discovery platform
-   cl_platform_id platform;
-   clGetPlatformIDs(1, &platform, NULL);
-
-   // Discover device
-   cl_device_id device;
-   clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device,
-      NULL);
+   // Platform, device, context and queue come from the shared runtime
+   OclRuntime* rt = oclRuntime();
+   cl_device_id device = rt->device;
 
     size_t time_res;
     clGetDeviceInfo(device, CL_DEVICE_PROFILING_TIMER_RESOLUTION,
             sizeof(time_res), &time_res, NULL);
     printf("Device profiling timer resolution: %zu ns.\n", time_res);
 
-   // Create context
-   cl_context_properties props[3] = {CL_CONTEXT_PLATFORM, 
-       (cl_context_properties)(platform), 0};
-   cl_context context; 
-   context = clCreateContext(props, 1, &device, NULL, NULL, 
-      NULL);
-
-   // Create command queue
-   cl_ulong time_start, time_end, exec_time;
-   cl_event timing_event;
-   cl_command_queue queue;
-   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, NULL);
+   cl_context context = rt->context;
+   cl_command_queue queue = rt->queue;
 
-   // Create memory buffers
-   cl_mem d_inputImage;
-   cl_mem d_outputImage;
+   // The filter buffer is shared by every strategy
+   size_t filterSize = filterWidth*filterWidth*sizeof(float);
    cl_mem d_filter;
-   d_inputImage = clCreateBuffer(context, CL_MEM_READ_ONLY, 
-       deviceDataSize, NULL, NULL);
-   d_outputImage = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
-       deviceDataSize, NULL, NULL);
    d_filter = clCreateBuffer(context, CL_MEM_READ_ONLY, 
-       49*sizeof(float),NULL, NULL);
-   
-   // Write input data to the device
-#ifdef NON_OPTIMIZED
-   clEnqueueWriteBuffer(queue, d_inputImage, CL_TRUE, 0, deviceDataSize,
-       inputImage, 0, NULL, NULL);
-#else // READ_ALIGNED || READ4
-   size_t buffer_origin[3] = {0,0,0};
-   size_t host_origin[3] = {0,0,0};
-   size_t region[3] = {deviceWidth*sizeof(float), 
-      imageHeight, 1};
-   clEnqueueWriteBufferRect(queue, d_inputImage, CL_TRUE, 
-      buffer_origin, host_origin, region, 
-      deviceWidth*sizeof(float), 0, imageWidth*sizeof(float), 0,
-      inputImage, 0, NULL, NULL);
-#endif
-	
-   // Write the filter to the device
+       filterSize, NULL, NULL);
    clEnqueueWriteBuffer(queue, d_filter, CL_TRUE, 0, 
-      49*sizeof(float), filter, 0, NULL, NULL);
+      filterSize, filter, 0, NULL, NULL);
+
+   // Rank-1 filters also get their row and column vectors, for the
+   // two-pass kernels
+   float* rowFilter = (float*)malloc(filterWidth*sizeof(float));
+   float* colFilter = (float*)malloc(filterWidth*sizeof(float));
+   int separable = trySeparable &&
+      separateFilter(filter, filterWidth, colFilter, rowFilter);
+   cl_mem d_rowFilter = NULL;
+   cl_mem d_colFilter = NULL;
+   if(separable) {
+      d_rowFilter = clCreateBuffer(context, CL_MEM_READ_ONLY,
+         filterWidth*sizeof(float), NULL, NULL);
+      d_colFilter = clCreateBuffer(context, CL_MEM_READ_ONLY,
+         filterWidth*sizeof(float), NULL, NULL);
+      clEnqueueWriteBuffer(queue, d_rowFilter, CL_TRUE, 0,
+         filterWidth*sizeof(float), rowFilter, 0, NULL, NULL);
+      clEnqueueWriteBuffer(queue, d_colFilter, CL_TRUE, 0,
+         filterWidth*sizeof(float), colFilter, 0, NULL, NULL);
+   }
+   printf("Filter: %s %dx%d, %s\n", filterName, filterWidth, filterWidth,
+      separable ? "separable (row and column passes)" : "full 2D");
 	
    // Read in the program from file
    char* source = readSource("convolution.cl");
 
-   // Create the program
-   cl_program program;
-	
-   // Create and compile the program
-   program = clCreateProgramWithSource(context, 1, 
-       (const char**)&source, NULL, NULL);
-   cl_int build_status;
-   build_status = clBuildProgram(program, 1, &device, NULL, NULL,
-      NULL);
-      
-   // Create the kernel
-   cl_kernel kernel;
-#if defined NON_OPTIMIZED || defined READ_ALIGNED
-   // Only the host-side code differs for the aligned reads
-   kernel = clCreateKernel(program, "convolution", NULL);
-#else // READ4
-   kernel = clCreateKernel(program, "convolution_read4", NULL);
-#endif
-	
-   // Selected work group size is 16x16
-   int wgWidth = WGX;
-   int wgHeight = WGY;
-
-   // When computing the total number of work items, the 
-   // padding work items do not need to be considered
-   int totalWorkItemsX = roundUp(imageWidth-paddingPixels, 
-      wgWidth);
-   int totalWorkItemsY = roundUp(imageHeight-paddingPixels, 
-      wgHeight);
-
-   // Size of a work group
-   size_t localSize[2] = {wgWidth, wgHeight};
-   // Size of the NDRange
-   size_t globalSize[2] = {totalWorkItemsX, totalWorkItemsY};
-
-   // The amount of local data that is cached is the size of the
-   // work groups plus the padding pixels
-#if defined NON_OPTIMIZED || defined READ_ALIGNED
-   int localWidth = localSize[0] + paddingPixels;
-#else // READ4
-   // Round the local width up to 4 for the read4 kernel
-   int localWidth = roundUp(localSize[0]+paddingPixels, 4);
-#endif
-   int localHeight = localSize[1] + paddingPixels;
+   // The direct kernels' cached tiles must fit in local memory
+   clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+      sizeof(localMemBytes), &localMemBytes, NULL);
 
-   // Compute the size of local memory (needed for dynamic 
-   // allocation)
-   size_t localMemSize = (localWidth * localHeight * 
-      sizeof(float));
-
-   // Set the kernel arguments
-   clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_inputImage);
-   clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_outputImage);
-   clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_filter);
-   clSetKernelArg(kernel, 3, sizeof(int), &deviceHeight);
-   clSetKernelArg(kernel, 4, sizeof(int), &deviceWidth); 
-   clSetKernelArg(kernel, 5, sizeof(int), &filterWidth);
-   clSetKernelArg(kernel, 6, localMemSize, NULL);
-   clSetKernelArg(kernel, 7, sizeof(int), &localHeight); 
-   clSetKernelArg(kernel, 8, sizeof(int), &localWidth);
+   // Create and compile the program
+   cl_program program = buildConvolution(rt, source, filterWidth);
+   if(filterWidth <= CONV_MAX_UNROLL_WIDTH) {
+      printf("Kernels built for -DFILTER_WIDTH=%d\n", filterWidth);
+   }
 
+   int chosen = chooseStrategy(imageWidth, filterWidth);
+   // The row and column passes have no float4 loads; read4's padded
+   // layout is the aligned one
+   if(separable && chosen == CONV_READ4) {
+      chosen = CONV_ALIGNED;
+   }
+   // Filters that are not separable switch to FFT from the measured
+   // crossover width on, and so do filters too wide for the direct
+   // kernels
+   if(tryFFT && !separable && (strategy == CONV_AUTO || bench)) {
+      int crossover = lookupCrossover(rt->device_name);
+      if(crossover == 0 || calibrate) {
+         crossover = measureCrossover(rt, source);
+         storeCrossover(rt->device_name, crossover);
+      }
+      printf("FFT convolution from %dx%d filters on\n", crossover,
+         crossover);
+      if(filterWidth >= crossover) {
+         chosen = CONV_FFT;
+      }
+   }
+   if(!strategyFits(chosen, filterWidth)) {
+      chosen = CONV_FFT;
+   }
+   if(!strategyFits(chosen, filterWidth)) {
+      printf("A %dx%d filter is too wide for every strategy\n",
+         filterWidth, filterWidth);
+      exit(1);
+   }
+   free(source);
+   if(strategy == CONV_AUTO) {
+      strategy = chosen;
+   }
+   else if(!strategyFits(strategy, filterWidth)) {
+      printf("Strategy %s does not support a %dx%d filter\n",
+         strategyNames[strategy], filterWidth, filterWidth);
+      exit(1);
+   }
+   if(separable && strategy == CONV_READ4) {
+      strategy = CONV_ALIGNED;
+   }
+   printf("Convolution strategy: %s (auto picks %s for a %dx%d image, "
+      "%dx%d filter)\n", strategyNames[strategy], strategyNames[chosen],
+      imageWidth, imageHeight, filterWidth, filterWidth);
    stoptime(start, "set up kernel");
-   start = clock();
-   // Execute the kernel
-   clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalSize, 
-      localSize, 0, NULL, &timing_event);
+   int twoPass = separable && strategy != CONV_FFT;
 
-   // Wait for kernel to complete
-   clFinish(queue);
-   stoptime(start, "run kernel");
-   clGetEventProfilingInfo(timing_event, CL_PROFILING_COMMAND_START,
-           sizeof(time_start), &time_start, NULL);
-   clGetEventProfilingInfo(timing_event, CL_PROFILING_COMMAND_END,
-           sizeof(time_end), &time_end, NULL);
-   exec_time = time_end-time_start;
-   printf("Profile execution time = %.3lf sec.\n", (double) exec_time/1000000000);
+   if(stream) {
+      start = clock();
+      streamConvolution(rt, program, strategy, inputFile, outputFile,
+         filter, twoPass ? d_rowFilter : d_filter,
+         twoPass ? d_colFilter : NULL, filterWidth, bandRows, &vopts);
+      stoptime(start, "stream image");
+   }
+   else {
+      float* refImage = (float*)malloc(dataSize);
+      VerifyResult check;
+      int result;
 
-   // Read back the output image
-#ifdef NON_OPTIMIZED
-   clEnqueueReadBuffer(queue, d_outputImage, CL_TRUE, 0, 
-      deviceDataSize, outputImage, 0, NULL, NULL);
-#else // READ_ALIGNED || READ4
-   // Begin reading output from (3,3) on the device 
-   // (for 7x7 filter with radius 3)
-   buffer_origin[0] = 3*sizeof(float);
-   buffer_origin[1] = 3;
-   buffer_origin[2] = 0;
-
-   // Read data into (3,3) on the host
-   host_origin[0] = 3*sizeof(float);
-   host_origin[1] = 3;
-   host_origin[2] = 0;
-	
-   // Region is image size minus padding pixels
-   region[0] = (imageWidth-paddingPixels)*sizeof(float);
-   region[1] = (imageHeight-paddingPixels);
-   region[2] = 1;
-	
-	// Perform the read
-   clEnqueueReadBufferRect(queue, d_outputImage, CL_TRUE, 
-      buffer_origin, host_origin, region, 
-      deviceWidth*sizeof(float), 0, imageWidth*sizeof(float), 0, 
-      outputImage, 0, NULL, NULL);
-#endif
+      // Run every strategy on the same input and compare kernel times
+      if(bench) {
+         float* benchImage = (float*)malloc(dataSize);
+         char label[32];
+         printf("%-12s %8s %14s %14s  %s\n", "Strategy", "Trials",
+            "Kernel min ms", "Kernel mean ms", "Result");
+         for(s = 1; s <= CONV_STRATEGIES; s++) {
+            if(!strategyFits(s, filterWidth)) {
+               printf("%-12s %8s %14s %14s  filter too wide\n",
+                  strategyNames[s], "-", "-", "-");
+               continue;
+            }
+            benchConvolution(rt, program, s, strategyNames[s], benchImage,
+               refImage, inputImage, imageHeight, imageWidth, filter,
+               d_filter, NULL, filterWidth, trials, &vopts,
+               !separable && s == chosen);
+            if(separable && s != CONV_READ4 && s != CONV_FFT) {
+               sprintf(label, "%s+sep", strategyNames[s]);
+               benchConvolution(rt, program, s, label, benchImage,
+                  refImage, inputImage, imageHeight, imageWidth, filter,
+                  d_rowFilter, d_colFilter, filterWidth, trials, &vopts,
+                  s == chosen);
+            }
+         }
+         free(benchImage);
+      }
+
+      start = clock();
+      double kernelTime = runConvolution(rt, program, strategy, outputImage,
+         inputImage, imageHeight, imageWidth,
+         twoPass ? d_rowFilter : d_filter, twoPass ? d_colFilter : NULL,
+         filterWidth);
+      stoptime(start, "run kernel");
+      printf("Profile execution time = %.3lf sec.\n", kernelTime);
   
-   // Homegrown function to write the image to file
-   storeImage(outputImage, outputFile, imageHeight, 
-      imageWidth, inputFile);
+      // Check against the host convolution
+      convolutionCPU(refImage, inputImage, outputImage, imageHeight,
+         imageWidth, filter, filterWidth);
+      result = verifyArrays(outputImage, refImage,
+         (size_t)imageHeight*imageWidth, VERIFY_FLOAT, &vopts, &check);
+      verifyReport(&check, outputImage, refImage, VERIFY_FLOAT, &vopts);
+      printf("Output is %s\n", result ? "correct" : "incorrect");
+      free(refImage);
+
+      // Homegrown function to write the image to file
+      storeImage(outputImage, outputFile, imageHeight, 
+         imageWidth, inputFile);
+   }
    
    // Free OpenCL objects
-   clReleaseMemObject(d_inputImage);
-   clReleaseMemObject(d_outputImage);
    clReleaseMemObject(d_filter);
-   clReleaseKernel(kernel);
-   clReleaseProgram(program);
-   clReleaseCommandQueue(queue);
-   clReleaseContext(context);
+   if(separable) {
+      clReleaseMemObject(d_rowFilter);
+      clReleaseMemObject(d_colFilter);
+   }
+   free(inputImage);
+   free(outputImage);
+   free(filter);
+   free(rowFilter);
+   free(colFilter);
+   oclReleaseRuntime();
 
    return 0;
 }
-
@@ -1,3 +1,15 @@
+// Built with -DFILTER_WIDTH=k the filter width is a compile-time constant:
+// the filter loops have fixed trip counts and are fully unrolled, and the
+// filterWidth argument is ignored. Without it any width is handled at
+// run time.
+#ifdef FILTER_WIDTH
+#define FW FILTER_WIDTH
+#define UNROLL _Pragma("unroll")
+#else
+#define FW filterWidth
+#define UNROLL
+#endif
+
 __kernel
 void convolution(__global float* imageIn,
                  __global float* imageOut, 
@@ -11,7 +23,7 @@ void convolution(__global float* imageIn,
     
     
     // Determine the amount of padding for this filter
-    int filterRadius = (filterWidth/2);
+    int filterRadius = (FW/2);
     int padding = filterRadius * 2;
     
     // Determine the size of the work group output region
@@ -59,28 +71,16 @@ void convolution(__global float* imageIn,
         float sum = 0.0f;
         int filterIdx = 0;
         
-         // Not unrolled
-         for(int i = localRow; i < localRow+filterWidth; i++) {
+         UNROLL
+         for(int i = localRow; i < localRow+FW; i++) {
             int offset = i*localWidth;
-            for(int j = localCol; j < localCol+filterWidth; j++){
+            UNROLL
+            for(int j = localCol; j < localCol+FW; j++){
                 sum += localImage[offset+j] * 
                    filter[filterIdx++];
             }
          }
         
-         /*
-         // Inner loop unrolled
-         for(int i = localRow; i < localRow+filterWidth; i++) {
-            int offset = i*localWidth+localCol;
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-         }
-         */
          
         // Write the data out
         imageOut[(globalRow+filterRadius)*cols + 
@@ -106,7 +106,7 @@ void convolution_read4(__global float4* imageIn,
     __local float4* localImage4;
     
     // Determine the amount of padding for this filter
-    int filterRadius = (filterWidth/2);
+    int filterRadius = (FW/2);
     int padding = filterRadius * 2;
     
     // Determine where each work group begins reading
@@ -156,107 +156,332 @@ void convolution_read4(__global float4* imageIn,
         float sum = 0.0f;
         int filterIdx = 0;
 
-        // Not unrolled
-        for(int i = localRow; i < localRow+filterWidth; i++) {
+        UNROLL
+        for(int i = localRow; i < localRow+FW; i++) {
             int offset = i*localWidth;
-            for(int j = localCol; j < localCol+filterWidth; j++){
+            UNROLL
+            for(int j = localCol; j < localCol+FW; j++){
                 sum += localImage[offset+j] * 
                     filter[filterIdx++];
             }
         }
         
-        /*
-        // Inner loop unrolled
-        for(int i = localRow; i < localRow+filterWidth; i++) {
-            int offset = i*localWidth+localCol;
-         
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-            sum += localImage[offset++] * filter[filterIdx++];
-        }
-        */
 
-        /*
-        // Completely unrolled
-        int offset = localRow*localWidth+localCol;
-        
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
-        
-        offset += localWidth;
-        
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
-        
-        offset += localWidth;
-        
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
         
-        offset += localWidth;
+        // Write the data out
+        imageOut[(globalRow+filterRadius)*cols + 
+           (globalCol+filterRadius)] = sum;
+    }
+    
+    return;
+}
+
+// Separable filters run as two passes with the same local memory tiling
+// as convolution. The row pass filters every row with the row vector and
+// writes the result at the window's first column, so the column pass can
+// index its input exactly like convolution indexes the image.
+__kernel
+void convolution_rows(__global float* imageIn,
+                      __global float* imageOut, 
+                    __constant float* filter, 
+                                 int  rows,
+                                 int  cols,
+                                 int  filterWidth,
+                       __local float* localImage,
+                                 int  localHeight,
+                                 int  localWidth) {
+    
+    // Only columns are padded in this pass
+    int padding = (FW/2) * 2;
+    
+    // Determine the size of the work group output region
+    int groupStartCol = get_group_id(0)*get_local_size(0);
+    int groupStartRow = get_group_id(1)*get_local_size(1);
+    
+    // Determine the local ID of each work item
+    int localCol = get_local_id(0);
+    int localRow = get_local_id(1);
+    
+    int globalCol = groupStartCol + localCol;
+    int globalRow = groupStartRow + localRow;   
+    
+    // Cache the data to local memory (localHeight is the work group 
+    // height here)
+    for(int i = localRow; i < localHeight; i += 
+        get_local_size(1)) {
         
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
+        int curRow = groupStartRow+i;
         
-        offset += localWidth;
+        for(int j = localCol; j < localWidth; j += 
+            get_local_size(0)) {
+            
+            int curCol = groupStartCol+j;
+            
+            if(curRow < rows && curCol < cols) {
+                localImage[i*localWidth + j] = 
+                    imageIn[curRow*cols+curCol];
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    // Every row is filtered, the column pass needs the border rows too
+    if(globalRow < rows && globalCol < cols-padding) {
         
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
+        float sum = 0.0f;
+        int offset = localRow*localWidth + localCol;
+        UNROLL
+        for(int j = 0; j < FW; j++) {
+            sum += localImage[offset+j] * filter[j];
+        }
         
-        offset += localWidth;
+        imageOut[globalRow*cols + globalCol] = sum;
+    }
+    
+    return;
+}
+
+__kernel
+void convolution_cols(__global float* imageIn,
+                      __global float* imageOut, 
+                    __constant float* filter, 
+                                 int  rows,
+                                 int  cols,
+                                 int  filterWidth,
+                       __local float* localImage,
+                                 int  localHeight,
+                                 int  localWidth) {
+    
+    // Only rows are padded in this pass
+    int filterRadius = (FW/2);
+    int padding = filterRadius * 2;
+    
+    // Determine the size of the work group output region
+    int groupStartCol = get_group_id(0)*get_local_size(0);
+    int groupStartRow = get_group_id(1)*get_local_size(1);
+    
+    // Determine the local ID of each work item
+    int localCol = get_local_id(0);
+    int localRow = get_local_id(1);
+    
+    int globalCol = groupStartCol + localCol;
+    int globalRow = groupStartRow + localRow;   
+    
+    // Cache the data to local memory (localWidth is the work group 
+    // width here)
+    for(int i = localRow; i < localHeight; i += 
+        get_local_size(1)) {
         
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
+        int curRow = groupStartRow+i;
         
-        offset += localWidth;
+        for(int j = localCol; j < localWidth; j += 
+            get_local_size(0)) {
+            
+            int curCol = groupStartCol+j;
+            
+            if(curRow < rows && curCol < cols) {
+                localImage[i*localWidth + j] = 
+                    imageIn[curRow*cols+curCol];
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if(globalRow < rows-padding && globalCol < cols-padding) {
         
-        sum += localImage[offset+0] * filter[filterIdx++];
-        sum += localImage[offset+1] * filter[filterIdx++];
-        sum += localImage[offset+2] * filter[filterIdx++];
-        sum += localImage[offset+3] * filter[filterIdx++];
-        sum += localImage[offset+4] * filter[filterIdx++];
-        sum += localImage[offset+5] * filter[filterIdx++];
-        sum += localImage[offset+6] * filter[filterIdx++];
-        */
+        float sum = 0.0f;
+        int offset = localRow*localWidth + localCol;
+        UNROLL
+        for(int i = 0; i < FW; i++) {
+            sum += localImage[offset] * filter[i];
+            offset += localWidth;
+        }
         
-        // Write the data out
         imageOut[(globalRow+filterRadius)*cols + 
            (globalCol+filterRadius)] = sum;
     }
     
     return;
 }
+
+// FFT convolution with overlap-save tiling. The image is cut into
+// tileSize x tileSize tiles (a power of two) that overlap by filterWidth-1
+// pixels, so the circular correlation of a tile with the zero-padded
+// filter has validSize = tileSize-filterWidth+1 rows and columns free of
+// wrap-around. A tile is stored row-major as complex values, and a batch
+// of tiles starting at firstTile is processed per launch.
+
+#define PI_F 3.14159265358979f
+
+// Complex product a*b
+float2 cmul(float2 a, float2 b) {
+    float2 r;
+    r.x = a.x*b.x - a.y*b.y;
+    r.y = a.x*b.y + a.y*b.x;
+    return r;
+}
+
+// Complex product a*conj(b)
+float2 cmulconj(float2 a, float2 b) {
+    float2 r;
+    r.x = a.x*b.x + a.y*b.y;
+    r.y = a.y*b.x - a.x*b.y;
+    return r;
+}
+
+// e^(i*angle)
+float2 twiddle(float angle) {
+    float2 r;
+    r.x = cos(angle);
+    r.y = sin(angle);
+    return r;
+}
+
+__kernel
+void fft_load_tiles(__global float* image,
+                    __global float2* tiles,
+                                 int rows,
+                                 int cols,
+                                 int tileSize,
+                                 int validSize,
+                                 int tilesX,
+                                 int firstTile) {
+    
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int tile = get_global_id(2);
+    
+    // Tiles step by validSize, anything past the image is zero
+    int t = firstTile + tile;
+    int imageRow = (t/tilesX)*validSize + row;
+    int imageCol = (t%tilesX)*validSize + col;
+    
+    float2 v;
+    v.x = 0.0f;
+    v.y = 0.0f;
+    if(imageRow < rows && imageCol < cols) {
+        v.x = image[imageRow*cols + imageCol];
+    }
+    tiles[(tile*tileSize + row)*tileSize + col] = v;
+}
+
+// One radix-2 Stockham pass over every line of every tile. Line l holds n
+// elements elemStride apart from l*lineStride (rows: 1 and n, columns: n
+// and 1), p is the size of the sub-transforms done so far and dir is -1
+// for the forward and 1 for the inverse transform.
+__kernel
+void fft_radix2(__global float2* in,
+                __global float2* out,
+                             int n,
+                             int p,
+                             int elemStride,
+                             int lineStride,
+                           float dir) {
+    
+    int i = get_global_id(0);
+    int base = get_global_id(2)*n*n + get_global_id(1)*lineStride;
+    int k = i & (p-1);
+    int j = ((i-k) << 1) + k;
+    
+    float2 u0 = in[base + i*elemStride];
+    float2 u1 = cmul(in[base + (i + n/2)*elemStride], 
+        twiddle(dir*PI_F*k/p));
+    
+    float2 y0, y1;
+    y0.x = u0.x + u1.x;
+    y0.y = u0.y + u1.y;
+    y1.x = u0.x - u1.x;
+    y1.y = u0.y - u1.y;
+    out[base + j*elemStride] = y0;
+    out[base + (j+p)*elemStride] = y1;
+}
+
+// One radix-4 Stockham pass, laid out like fft_radix2
+__kernel
+void fft_radix4(__global float2* in,
+                __global float2* out,
+                             int n,
+                             int p,
+                             int elemStride,
+                             int lineStride,
+                           float dir) {
+    
+    int i = get_global_id(0);
+    int base = get_global_id(2)*n*n + get_global_id(1)*lineStride;
+    int quarter = n/4;
+    int k = i & (p-1);
+    int j = ((i-k) << 2) + k;
+    float angle = dir*PI_F*k/(2*p);
+    
+    float2 u0 = in[base + i*elemStride];
+    float2 u1 = cmul(in[base + (i + quarter)*elemStride], twiddle(angle));
+    float2 u2 = cmul(in[base + (i + 2*quarter)*elemStride], 
+        twiddle(2*angle));
+    float2 u3 = cmul(in[base + (i + 3*quarter)*elemStride], 
+        twiddle(3*angle));
+    
+    // 4-point DFT, the odd difference rotated by dir*i
+    float2 a0, a1, a2, a3, y;
+    a0.x = u0.x + u2.x;
+    a0.y = u0.y + u2.y;
+    a1.x = u0.x - u2.x;
+    a1.y = u0.y - u2.y;
+    a2.x = u1.x + u3.x;
+    a2.y = u1.y + u3.y;
+    a3.x = -dir*(u1.y - u3.y);
+    a3.y = dir*(u1.x - u3.x);
+    
+    y.x = a0.x + a2.x;
+    y.y = a0.y + a2.y;
+    out[base + j*elemStride] = y;
+    y.x = a1.x + a3.x;
+    y.y = a1.y + a3.y;
+    out[base + (j+p)*elemStride] = y;
+    y.x = a0.x - a2.x;
+    y.y = a0.y - a2.y;
+    out[base + (j+2*p)*elemStride] = y;
+    y.x = a1.x - a3.x;
+    y.y = a1.y - a3.y;
+    out[base + (j+3*p)*elemStride] = y;
+}
+
+// Multiplying by the conjugate filter spectrum turns the circular
+// convolution into the correlation the direct kernels compute
+__kernel
+void fft_multiply(__global float2* tiles,
+                  __global float2* filterSpectrum,
+                               int tileArea) {
+    
+    int e = get_global_id(0);
+    int idx = get_global_id(1)*tileArea + e;
+    tiles[idx] = cmulconj(tiles[idx], filterSpectrum[e]);
+}
+
+__kernel
+void fft_store_tiles(__global float2* tiles,
+                     __global float* image,
+                                  int rows,
+                                  int cols,
+                                  int tileSize,
+                                  int validSize,
+                                  int tilesX,
+                                  int firstTile,
+                                  int filterRadius,
+                                float scale) {
+    
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int tile = get_global_id(2);
+    int padding = filterRadius * 2;
+    
+    // Output (row, col) of a tile is the window starting at the same
+    // pixel of the tile, written at the window center
+    int t = firstTile + tile;
+    int outRow = (t/tilesX)*validSize + row;
+    int outCol = (t%tilesX)*validSize + col;
+    
+    if(outRow < rows-padding && outCol < cols-padding) {
+        image[(outRow+filterRadius)*cols + (outCol+filterRadius)] = 
+            tiles[(tile*tileSize + row)*tileSize + col].x * scale;
+    }
+}